@@ -6,8 +6,35 @@
 #include <sstream>
 #include <cmath>
 #include <unordered_map>
-#include <regex>
 #include <unordered_set>
+#include <limits>
+#include <filesystem>
+#include <string_view>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <random>
+#include <chrono>
+#include <execution>
+#include <numeric>
+#include <memory>
+#include <coroutine>
+
+// scoring server listens on a Unix domain socket
+#if defined(__unix__) || defined(__APPLE__)
+#define SCORING_SERVER_SUPPORTED
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 struct NGram {
@@ -28,6 +55,265 @@ enum SmoothingType {
 };
 
 
+// splits range [0, count) into contiguous chunks and processes each chunk on its own thread
+void parallelFor(size_t count, const std::function<void(size_t, size_t)> &body) {
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min(numThreads, std::max<size_t>(count, 1));
+    if (numThreads == 1) {
+        body(0, count);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads);
+    size_t chunkSize = (count + numThreads - 1) / numThreads;
+    for (size_t begin = 0; begin < count; begin += chunkSize) {
+        size_t end = std::min(begin + chunkSize, count);
+        threads.emplace_back(body, begin, end);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+
+// parallelFor for uneven work: range is cut into grains and every thread starts on its own contiguous share of grains,
+// a thread with an empty queue steals grains from the back of other queues
+void parallelForStealing(size_t count, size_t grainSize, const std::function<void(size_t, size_t)> &body) {
+    grainSize = std::max<size_t>(grainSize, 1);
+    size_t numGrains = (count + grainSize - 1) / grainSize;
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min(numThreads, std::max<size_t>(numGrains, 1));
+    if (numThreads == 1) {
+        body(0, count);
+        return;
+    }
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<size_t> grains;
+    };
+    std::vector<WorkQueue> queues(numThreads);
+    for (size_t grain = 0; grain < numGrains; ++grain) {
+        queues[grain * numThreads / numGrains].grains.push_back(grain);
+    }
+
+    // no grains are added after start, so a thread is done once all queues are empty
+    auto worker = [&](size_t self) {
+        while (true) {
+            size_t grain = numGrains;
+            for (size_t i = 0; i < numThreads && grain == numGrains; ++i) {
+                WorkQueue &queue = queues[(self + i) % numThreads];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.grains.empty()) {
+                    continue;
+                }
+                // own grains are taken from the front, so a thread walks its share in order
+                if (i == 0) {
+                    grain = queue.grains.front();
+                    queue.grains.pop_front();
+                }
+                else {
+                    grain = queue.grains.back();
+                    queue.grains.pop_back();
+                }
+            }
+            if (grain == numGrains) {
+                return;
+            }
+            body(grain * grainSize, std::min((grain + 1) * grainSize, count));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads - 1);
+    for (size_t i = 1; i < numThreads; ++i) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+
+// builds lookup key for N-gram starting at given position (same format as keys in buildNGrams)
+std::string joinNGramKey(const std::vector<std::string> &words, size_t begin, int n) {
+    std::string key;
+    key.reserve(n * 20);
+    for (int i = 0; i < n; ++i) {
+        key += words[begin + i] + " ";
+    }
+    return key;
+}
+
+
+// splitmix64 finalizer, used to derive independent hashes from a single key hash
+uint64_t mixHash(uint64_t x, uint64_t seed) {
+    x += seed * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+
+// FNV-1a of string bytes with splitmix64 finalizer, unlike std::hash the same with every compiler and standard library,
+// so it can be used for hashes stored in files
+uint64_t hashString(std::string_view text) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+    return mixHash(hash, 0);
+}
+
+
+// word <--> integer ID mapping used by columnar and binary models
+struct Vocabulary {
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::string> words;
+};
+
+
+const uint32_t UNKNOWN_WORD = UINT32_MAX;
+
+// N-gram of up to 3 word IDs is packed into a single 64-bit key
+const int WORD_ID_BITS = 21;
+const uint32_t MAX_VOCABULARY_SIZE = 1u << WORD_ID_BITS;
+
+
+uint32_t internWord(Vocabulary &vocabulary, const std::string &word) {
+    auto [it, inserted] = vocabulary.ids.emplace(word, static_cast<uint32_t>(vocabulary.words.size()));
+    if (inserted) {
+        vocabulary.words.push_back(word);
+    }
+    return it->second;
+}
+
+
+uint32_t findWord(const Vocabulary &vocabulary, const std::string &word) {
+    auto it = vocabulary.ids.find(word);
+    return (it != vocabulary.ids.end()) ? it->second : UNKNOWN_WORD;
+}
+
+
+// first word ends up in the highest bits, so sorted keys are grouped by history
+uint64_t packNGramKey(const uint32_t *ids, int n) {
+    uint64_t key = 0;
+    for (int i = 0; i < n; ++i) {
+        key = (key << WORD_ID_BITS) | ids[i];
+    }
+    return key;
+}
+
+
+// model stored column by column instead of as vector of NGram structs, so passes over a single field are streaming
+struct ColumnarModel {
+    int n{};
+    Vocabulary vocabulary;
+    // one column of word IDs per position in N-gram
+    std::vector<std::vector<uint32_t>> wordIds;
+    std::vector<int> counts;
+    std::vector<double> probabilities;
+};
+
+
+uint64_t rowKey(const ColumnarModel &model, size_t row) {
+    uint32_t ids[64 / WORD_ID_BITS];
+    for (int i = 0; i < model.n; ++i) {
+        ids[i] = model.wordIds[i][row];
+    }
+    return packNGramKey(ids, model.n);
+}
+
+
+// rows end up sorted by packed key, so N-grams with the same history are next to each other
+ColumnarModel toColumnarModel(const std::vector<NGram> &ngrams, int n) {
+    ColumnarModel model;
+    model.n = n;
+    model.wordIds.resize(n);
+    if (n > 64 / WORD_ID_BITS) {
+        std::cerr << "Columnar models support N-grams of at most " << 64 / WORD_ID_BITS << " words." << std::endl;
+        return model;
+    }
+
+    // intern words and drop malformed or duplicate N-grams
+    std::vector<std::pair<uint64_t, const NGram*>> rows;
+    rows.reserve(ngrams.size());
+    uint32_t ids[64 / WORD_ID_BITS];
+    for (const auto &ngram : ngrams) {
+        if (ngram.words.size() != static_cast<size_t>(n)) {
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            ids[i] = internWord(model.vocabulary, ngram.words[i]);
+        }
+        rows.emplace_back(packNGramKey(ids, n), &ngram);
+    }
+    if (model.vocabulary.words.size() > MAX_VOCABULARY_SIZE) {
+        std::cerr << "Vocabulary is too large for columnar model." << std::endl;
+        return {};
+    }
+    std::stable_sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    rows.erase(std::unique(rows.begin(), rows.end(), [](const auto &a, const auto &b) { return a.first == b.first; }), rows.end());
+
+    for (auto &column : model.wordIds) {
+        column.reserve(rows.size());
+    }
+    model.counts.reserve(rows.size());
+    model.probabilities.reserve(rows.size());
+    for (const auto &[key, ngram] : rows) {
+        for (int i = 0; i < n; ++i) {
+            model.wordIds[i].push_back(findWord(model.vocabulary, ngram->words[i]));
+        }
+        model.counts.push_back(ngram->count);
+        model.probabilities.push_back(ngram->probability);
+    }
+    return model;
+}
+
+
+// first row of every history in a model sorted by packed key, followed by number of rows
+std::vector<size_t> findHistoryBoundaries(const ColumnarModel &model) {
+    const size_t size = model.probabilities.size();
+    std::vector<size_t> boundaries;
+    if (size == 0) {
+        return boundaries;
+    }
+
+    // row starts a new history if any history word differs from previous row
+    std::vector<uint8_t> changed(size, 0);
+    changed[0] = 1;
+    for (int i = 0; i < model.n - 1; ++i) {
+        const uint32_t *column = model.wordIds[i].data();
+        uint8_t *flags = changed.data();
+        for (size_t row = 1; row < size; ++row) {
+            flags[row] |= static_cast<uint8_t>(column[row] != column[row - 1]);
+        }
+    }
+    for (size_t row = 0; row < size; ++row) {
+        if (changed[row]) {
+            boundaries.push_back(row);
+        }
+    }
+    boundaries.push_back(size);
+    return boundaries;
+}
+
+
+// probability mass of every history between boundaries from findHistoryBoundaries
+std::vector<double> calculateHistoryMasses(const ColumnarModel &model, const std::vector<size_t> &boundaries) {
+    std::vector<double> masses(boundaries.empty() ? 0 : boundaries.size() - 1);
+    const double *probabilities = model.probabilities.data();
+    parallelFor(masses.size(), [&](size_t begin, size_t end) {
+        for (size_t h = begin; h < end; ++h) {
+            masses[h] = std::reduce(std::execution::unseq, probabilities + boundaries[h], probabilities + boundaries[h + 1], 0.0);
+        }
+    });
+    return masses;
+}
+
+
 void printCorpusContents(const std::string &fileName) {
     std::ifstream corpusFile;
     corpusFile.open(fileName);
@@ -71,136 +357,422 @@ std::vector<std::string> countCorpus(const std::string &fileName, bool unique) {
 }
 
 
-std::vector<std::string> preprocessAndTokenize(const std::string &fileName, bool xml) {
-    std::ifstream corpusFile;
-    corpusFile.open(fileName);
-    if (!corpusFile.is_open()) {
-        std::cerr << "Unable to open the file." << std::endl;
-        return {};
+std::string decodeXmlEntities(const std::string &text) {
+    static const std::pair<std::string, std::string> entities[] = {
+        {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}, {"&amp;", "&"}
+    };
+    std::string decoded = text;
+    for (const auto &[entity, character] : entities) {
+        for (size_t pos = decoded.find(entity); pos != std::string::npos; pos = decoded.find(entity, pos + character.size())) {
+            decoded.replace(pos, entity.size(), character);
+        }
     }
+    return decoded;
+}
 
-    // processing XML file
-    if (xml) {
-        // read the XML content
-        std::string xmlContent((std::istreambuf_iterator<char>(corpusFile)), std::istreambuf_iterator<char>());
 
-        // remove XML tags
-        std::regex xmlTagRegex("<[^>]+>");
-        std::string plainText = std::regex_replace(xmlContent, xmlTagRegex, "");
-        std::string cleanedText = std::regex_replace(plainText, std::regex("<p>|</?p>|<div>|</?div>|<body>|</?body>"), "");
+// removes punctuations (.,:;!?) from token and converts it to lower case
+void normalizeToken(std::string &token) {
+    token.erase(std::remove_if(token.begin(), token.end(), [](unsigned char c) { return std::ispunct(c); }),
+                token.end());
+    std::transform(token.begin(), token.end(), token.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+}
 
-        std::vector<std::string> tokens;
-        std::string line;
-        std::vector<std::string> lines;
-        std::istringstream iss(cleanedText);
-        while (std::getline(iss, line)) {
-            if (line != "" && line != " ") {
-                lines.push_back(line);
-            }
+
+// abbreviations (lower case, without period) that are usually followed by a period inside of a sentence
+const std::unordered_set<std::string_view> SLOVENIAN_ABBREVIATIONS = {
+    "dr", "mag", "prof", "doc", "izr", "red", "univ", "dipl", "inž", "ing", "ur", "opr",
+    "npr", "oz", "itd", "ipd", "idr", "tj", "ti", "t", "i", "d", "o", "b", "j", "g", "l", "p", "s", "m",
+    "angl", "nem", "lat", "fr", "it", "star", "sl", "gl", "op", "opred", "sig", "str", "št", "tab",
+    "cca", "pribl", "mio", "mrd", "vs", "ca", "ipl", "jan", "feb", "mar", "apr", "jun", "jul", "avg",
+    "sep", "okt", "nov", "dec", "tel", "ul", "čl", "odst", "ii", "iii", "iv", "vi", "vii", "viii", "ix"
+};
+
+
+// code point of Slovenian letter outside of ASCII at the start of word (0 for anything else)
+uint32_t slovenianLetter(std::string_view word) {
+    if (word.size() < 2 || (static_cast<unsigned char>(word[0]) & 0xe0) != 0xc0) {
+        return 0;
+    }
+    uint32_t codePoint = (static_cast<unsigned char>(word[0]) & 0x1f) << 6 | (static_cast<unsigned char>(word[1]) & 0x3f);
+    // upper case Č, Ć, Đ, Š, Ž, each lower case letter is the next code point
+    for (uint32_t upper : {0x10cu, 0x106u, 0x110u, 0x160u, 0x17du}) {
+        if (codePoint == upper || codePoint == upper + 1) {
+            return codePoint;
         }
+    }
+    return 0;
+}
 
-        for (const auto &line: lines) {
-            // input string stream made from current file line
-            std::istringstream iss(line);
-            // storing each token
-            std::string token;
 
-            // add opening tag
-            tokens.emplace_back("<s>");
+bool isSlovenianUppercase(uint32_t codePoint) {
+    return codePoint == 0x10c || codePoint == 0x106 || codePoint == 0x110 || codePoint == 0x160 || codePoint == 0x17d;
+}
 
-            while (iss >> token) {
-                // remove punctuations (.,:;!?) from token
-                token.erase(std::remove_if(token.begin(), token.end(), [](unsigned char c) { return std::ispunct(c); }),
-                            token.end());
-                // convert token to lower case
-                std::transform(token.begin(), token.end(), token.begin(),
-                               [](unsigned char c) { return std::tolower(c); });
-                // add token to list of tokens
-                tokens.push_back(token);
-            }
 
-            // add closing tag
-            tokens.emplace_back("</s>");
+bool startsLowercase(std::string_view word) {
+    if (word.empty()) {
+        return false;
+    }
+    unsigned char first = word[0];
+    if (first < 0x80) {
+        return std::islower(first);
+    }
+    uint32_t letter = slovenianLetter(word);
+    return letter != 0 && !isSlovenianUppercase(letter);
+}
+
+
+// lower case of ASCII and Slovenian letters (upper and lower case of č, ć, đ, š, ž differ only in the second byte)
+std::string lowercaseWord(std::string_view word) {
+    std::string lowercase(word);
+    for (size_t i = 0; i < lowercase.size(); ++i) {
+        unsigned char c = lowercase[i];
+        if (c < 0x80) {
+            lowercase[i] = static_cast<char>(std::tolower(c));
+        }
+        else if (isSlovenianUppercase(slovenianLetter(std::string_view(lowercase).substr(i)))) {
+            lowercase[i + 1]++;
         }
+    }
+    return lowercase;
+}
 
-        corpusFile.close();
-        return tokens;
+
+// decides whether a sentence ends between two consecutive (not normalized) words
+bool endsSentence(std::string_view word, std::string_view nextWord) {
+    // strip closing quotes and brackets
+    while (!word.empty() && std::string_view(")]\"'»«").find(word.back()) != std::string_view::npos) {
+        word.remove_suffix(1);
+    }
+    if (word.empty()) {
+        return false;
     }
 
-    // processing TEXT file
-    else {
-        std::string line;
-        std::vector<std::string> tokens;
+    bool ellipsis = word.size() >= 3 && word.substr(word.size() - 3) == "\xe2\x80\xa6";
+    char last = word.back();
+    if (last != '.' && last != '!' && last != '?' && !ellipsis) {
+        return false;
+    }
+    // sentences never continue with a lower case word
+    if (startsLowercase(nextWord)) {
+        return false;
+    }
+    if (last != '.') {
+        return true;
+    }
+
+    // word in front of the period
+    std::string_view stem = word.substr(0, word.find_last_not_of('.') + 1);
+    while (!stem.empty() && std::string_view("(\"'»«").find(stem.front()) != std::string_view::npos) {
+        stem.remove_prefix(1);
+    }
+    if (stem.empty()) {
+        return true;
+    }
+    // ordinal numbers and dates (5. 3. 2005) continue with a number
+    bool numeric = std::all_of(stem.begin(), stem.end(), [](unsigned char c) { return std::isdigit(c); });
+    if (numeric) {
+        return nextWord.empty() || !std::isdigit(static_cast<unsigned char>(nextWord[0]));
+    }
+    // initials (P. Božič, Š. Novak)
+    if ((stem.size() == 1 && std::isupper(static_cast<unsigned char>(stem[0])))
+        || (stem.size() == 2 && isSlovenianUppercase(slovenianLetter(stem)))) {
+        return false;
+    }
+    return SLOVENIAN_ABBREVIATIONS.find(lowercaseWord(stem)) == SLOVENIAN_ABBREVIATIONS.end();
+}
 
-        while (std::getline(corpusFile, line)) {
-            // input string stream made from current file line
-            std::istringstream iss(line);
-            // storing each token
-            std::string token;
 
-            // add opening tag
-            tokens.emplace_back("<s>");
+// numbering of chapters and lists (1. or 2.3.) at the start of a sentence does not end it
+bool isNumbering(std::string_view word) {
+    return !word.empty() && word.back() == '.'
+           && std::all_of(word.begin(), word.end(), [](unsigned char c) { return std::isdigit(c) || c == '.'; });
+}
 
-            while (iss >> token) {
-                // remove punctuations (.,:;!?) from token
-                token.erase(std::remove_if(token.begin(), token.end(), [](unsigned char c) { return std::ispunct(c); }),
-                            token.end());
-                // convert token to lower case
-                std::transform(token.begin(), token.end(), token.begin(),
-                               [](unsigned char c) { return std::tolower(c); });
-                // add token to list of tokens
-                tokens.push_back(token);
-            }
 
-            // add closing tag
-            tokens.emplace_back("</s>");
+// splits text into sentences, returned views point into text (nothing is copied)
+void splitSentences(std::string_view text, std::vector<std::string_view> &sentences) {
+    auto isSpace = [](char c) { return std::isspace(static_cast<unsigned char>(c)); };
+    size_t sentenceBegin = std::string_view::npos;
+    std::string_view previousWord;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        while (pos < text.size() && isSpace(text[pos])) {
+            pos++;
+        }
+        if (pos == text.size()) {
+            break;
         }
+        size_t wordBegin = pos;
+        while (pos < text.size() && !isSpace(text[pos])) {
+            pos++;
+        }
+        std::string_view word = text.substr(wordBegin, pos - wordBegin);
 
-        corpusFile.close();
-        return tokens;
+        if (sentenceBegin == std::string_view::npos) {
+            sentenceBegin = wordBegin;
+        }
+        else if (endsSentence(previousWord, word) && !(previousWord.data() == text.data() + sentenceBegin && isNumbering(previousWord))) {
+            const char *previousEnd = previousWord.data() + previousWord.size();
+            sentences.push_back(text.substr(sentenceBegin, previousEnd - text.data() - sentenceBegin));
+            sentenceBegin = wordBegin;
+        }
+        previousWord = word;
+    }
+    if (sentenceBegin != std::string_view::npos) {
+        const char *previousEnd = previousWord.data() + previousWord.size();
+        sentences.push_back(text.substr(sentenceBegin, previousEnd - text.data() - sentenceBegin));
     }
 }
 
 
-template<typename NGramType>
-std::vector<NGramType> buildNGrams(const std::vector<std::string> &tokens, int n, SmoothingType smoothingType) {
-    std::vector<NGramType> ngrams;
-    if (n < 2) {
-        std::cerr << "N-grams must have a minimum size of 2." << std::endl;
-        return ngrams;
+// appends every sentence of text as <s> normalized tokens </s>, words empty after normalization are dropped
+void appendSentenceTokens(std::string_view text, std::vector<std::string> &tokens) {
+    std::vector<std::string_view> sentences;
+    splitSentences(text, sentences);
+    for (std::string_view sentence : sentences) {
+        tokens.emplace_back("<s>");
+        size_t pos = 0;
+        while (pos < sentence.size()) {
+            size_t end = pos;
+            while (end < sentence.size() && !std::isspace(static_cast<unsigned char>(sentence[end]))) {
+                end++;
+            }
+            if (end > pos) {
+                std::string token(sentence.substr(pos, end - pos));
+                normalizeToken(token);
+                if (!token.empty()) {
+                    tokens.push_back(std::move(token));
+                }
+            }
+            pos = end + 1;
+        }
+        tokens.emplace_back("</s>");
     }
+}
 
-    std::unordered_map<std::string, int> wordCount;
-    std::unordered_map<std::string, int> precedingWordCount;
 
-    // preallocate memory for vector of N-grams
-    ngrams.reserve(tokens.size() - (n - 1));
+// token of a document together with byte offset of its first character in the source file
+struct SourceToken {
+    std::string text;
+    size_t offset{};
+};
 
-    for (size_t i = 0; i < tokens.size() - (n - 1); ++i) {
-        NGramType ngram;
-        for (int j = 0; j < n; ++j) {
-            ngram.words.push_back(tokens[i+j]);
+
+struct XmlExtractionOptions {
+    // number of pages at the start of document that are skipped (title page, contents ...)
+    int skipPages = 0;
+    // sentences are found with endsSentence and may continue in the next paragraph,
+    // otherwise every paragraph is one sentence
+    bool splitSentences = true;
+};
+
+
+// streaming (SAX style) extraction of paragraph text from .text.xml documents
+//
+// text of <p> elements is split into sentences wrapped in <s> and </s>, a sentence can continue in the next paragraph
+// (hard-wrapped lines) but never crosses a page break, all text outside of <p> elements (and on skipped pages) is ignored
+// (same sentences as blank-line separated blocks of the .text.txt file)
+std::vector<SourceToken> extractXmlTokens(const std::string &fileName, const XmlExtractionOptions &options) {
+    std::vector<SourceToken> tokens;
+    std::ifstream xmlFile(fileName, std::ios::binary);
+    if (!xmlFile.is_open()) {
+        std::cerr << "Unable to open the file." << std::endl;
+        return tokens;
+    }
+
+    enum State { TEXT, TAG, ENTITY };
+    State state = TEXT;
+    std::string tag;
+    std::string entity;
+    std::string word;
+    size_t wordOffset = 0;
+    // previous word is kept until the next one is known, so sentence boundary between them can be decided
+    std::string previousWord;
+    size_t previousOffset = 0;
+    size_t sentenceWords = 0;
+    size_t entityOffset = 0;
+    int page = 0;
+    bool inParagraph = false;
+    // <s> is written before the first word of a sentence
+    bool inSentence = false;
+
+    auto flushPreviousWord = [&]() {
+        normalizeToken(previousWord);
+        if (!previousWord.empty()) {
+            tokens.push_back({previousWord, previousOffset});
         }
-        ngram.count = 1;
+        previousWord.clear();
+    };
+    auto emitWord = [&]() {
+        if (word.empty()) {
+            return;
+        }
+        if (!previousWord.empty()) {
+            bool boundary = options.splitSentences && endsSentence(previousWord, word)
+                    && !(sentenceWords == 1 && isNumbering(previousWord));
+            flushPreviousWord();
+            if (boundary) {
+                tokens.push_back({"</s>", wordOffset});
+                inSentence = false;
+            }
+        }
+        if (!inSentence) {
+            tokens.push_back({"<s>", wordOffset});
+            inSentence = true;
+            sentenceWords = 0;
+        }
+        sentenceWords++;
+        previousWord.swap(word);
+        previousOffset = wordOffset;
+        word.clear();
+    };
+    auto endSentence = [&](size_t offset) {
+        emitWord();
+        flushPreviousWord();
+        if (inSentence) {
+            tokens.push_back({"</s>", offset});
+            inSentence = false;
+        }
+    };
+    auto appendCharacter = [&](char c, size_t offset) {
+        if (!inParagraph || page <= options.skipPages) {
+            return;
+        }
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            emitWord();
+            return;
+        }
+        if (word.empty()) {
+            wordOffset = offset;
+        }
+        word += c;
+    };
+    auto handleTag = [&](size_t offset) {
+        bool closing = !tag.empty() && tag[0] == '/';
+        bool selfClosing = !tag.empty() && tag.back() == '/';
+        size_t nameBegin = closing ? 1 : 0;
+        size_t nameEnd = tag.find_first_of(" \t\r\n/", nameBegin);
+        std::string name = tag.substr(nameBegin, (nameEnd == std::string::npos ? tag.size() : nameEnd) - nameBegin);
 
-        // count occurrences of every word
-        std::string nGramKey;
-        // preallocate memory to avoid frequent reallocations during string concatenation inside the loop (20 - arbitrary average word length estimation)
-        nGramKey.reserve(n * 20);
-        for (const auto &word : ngram.words) {
-            nGramKey += word + " ";
+        if (name == "page" && !closing) {
+            endSentence(offset);
+            page++;
         }
-        wordCount[nGramKey]++;
-        precedingWordCount[nGramKey.substr(0, ngram.words[0].size() + 1)]++;
+        else if (name == "p" && page > options.skipPages) {
+            if (!closing && !selfClosing) {
+                inParagraph = true;
+            }
+            else if (closing && inParagraph) {
+                if (options.splitSentences) {
+                    emitWord();
+                }
+                else {
+                    endSentence(offset);
+                }
+                inParagraph = false;
+            }
+        }
+    };
 
-        // check for duplicate N-grams
-        auto it = std::find(ngrams.begin(), ngrams.end(), ngram);
-        if (it != ngrams.end()) {
-            it->count++;
-        } else {
-            ngrams.push_back(ngram);
+    char buffer[1 << 16];
+    size_t offset = 0;
+    size_t tagOffset = 0;
+    while (xmlFile.read(buffer, sizeof(buffer)) || xmlFile.gcount() > 0) {
+        const std::streamsize bytes = xmlFile.gcount();
+        for (std::streamsize i = 0; i < bytes; ++i, ++offset) {
+            const char c = buffer[i];
+            switch (state) {
+                case TEXT:
+                    if (c == '<') {
+                        state = TAG;
+                        tag.clear();
+                        tagOffset = offset;
+                    }
+                    else if (c == '&') {
+                        state = ENTITY;
+                        entity.clear();
+                        entityOffset = offset;
+                    }
+                    else {
+                        appendCharacter(c, offset);
+                    }
+                    break;
+                case TAG:
+                    if (c == '>') {
+                        state = TEXT;
+                        handleTag(tagOffset);
+                    }
+                    else {
+                        tag += c;
+                    }
+                    break;
+                case ENTITY:
+                    if (c == ';') {
+                        state = TEXT;
+                        std::string decoded = decodeXmlEntities("&" + entity + ";");
+                        for (char d : decoded) {
+                            appendCharacter(d, entityOffset);
+                        }
+                    }
+                    else {
+                        entity += c;
+                    }
+                    break;
+            }
+        }
+    }
+    endSentence(offset);
+    return tokens;
+}
+
+
+std::vector<std::string> preprocessAndTokenize(const std::string &fileName, bool xml) {
+    // processing XML file
+    if (xml) {
+        std::vector<std::string> tokens;
+        for (auto &token : extractXmlTokens(fileName, XmlExtractionOptions())) {
+            tokens.push_back(std::move(token.text));
+        }
+        return tokens;
+    }
+
+    std::ifstream corpusFile;
+    corpusFile.open(fileName);
+    if (!corpusFile.is_open()) {
+        std::cerr << "Unable to open the file." << std::endl;
+        return {};
+    }
+
+    // processing TEXT file
+    // lines are joined into blocks (hard-wrapped sentences continue on next line), blank lines always end a sentence
+    std::string line;
+    std::string block;
+    std::vector<std::string> tokens;
+    while (std::getline(corpusFile, line)) {
+        if (std::all_of(line.begin(), line.end(), [](unsigned char c) { return std::isspace(c); })) {
+            appendSentenceTokens(block, tokens);
+            block.clear();
+            continue;
+        }
+        if (!block.empty()) {
+            block += ' ';
         }
+        block += line;
     }
+    appendSentenceTokens(block, tokens);
+
+    corpusFile.close();
+    return tokens;
+}
+
+
+// assigns smoothed probabilities to counted N-grams
+template<typename NGramType>
+void smoothNGrams(std::vector<NGramType> &ngrams, int n, SmoothingType smoothingType, size_t vocabularySize) {
+    const double numUniqueWords = static_cast<double>(vocabularySize);
 
     // calculating N-gram probabilities
     //
@@ -276,9 +848,6 @@ std::vector<NGramType> buildNGrams(const std::vector<std::string> &tokens, int n
             }
         }
 
-        std::unordered_set<std::string> uniqueTokens(tokens.begin(), tokens.end());
-        double numUniqueWords = uniqueTokens.size();
-
         for (auto& ngram : ngrams) {
             std::string precedingWords;
             for (int i = 0; i < n - 1; ++i) {
@@ -303,20 +872,972 @@ std::vector<NGramType> buildNGrams(const std::vector<std::string> &tokens, int n
             ngram.probability = (std::max(ngram.count - D, 0.0) / c) + (lambda * continuationProbability);
         }
     }
-
-    return ngrams;
 }
 
 
-void printNGrams(const std::vector<NGram>& ngrams) {
-    for (const auto &ngram: ngrams) {
-        std::cout << "(";
-        for (const auto& word : ngram.words) {
-            std::cout << word << ", ";
-        }
-        std::cout << "\b\b): " << ngram.count << " (" << ngram.probability << ")\n";
+template<typename NGramType>
+std::vector<NGramType> buildNGrams(const std::vector<std::string> &tokens, int n, SmoothingType smoothingType) {
+    std::vector<NGramType> ngrams;
+    if (n < 2) {
+        std::cerr << "N-grams must have a minimum size of 2." << std::endl;
+        return ngrams;
     }
-}
+
+    std::unordered_map<std::string, int> wordCount;
+    std::unordered_map<std::string, int> precedingWordCount;
+
+    // preallocate memory for vector of N-grams
+    ngrams.reserve(tokens.size() - (n - 1));
+
+    for (size_t i = 0; i < tokens.size() - (n - 1); ++i) {
+        NGramType ngram;
+        for (int j = 0; j < n; ++j) {
+            ngram.words.push_back(tokens[i+j]);
+        }
+        ngram.count = 1;
+
+        // count occurrences of every word
+        std::string nGramKey;
+        // preallocate memory to avoid frequent reallocations during string concatenation inside the loop (20 - arbitrary average word length estimation)
+        nGramKey.reserve(n * 20);
+        for (const auto &word : ngram.words) {
+            nGramKey += word + " ";
+        }
+        wordCount[nGramKey]++;
+        precedingWordCount[nGramKey.substr(0, ngram.words[0].size() + 1)]++;
+
+        // check for duplicate N-grams
+        auto it = std::find(ngrams.begin(), ngrams.end(), ngram);
+        if (it != ngrams.end()) {
+            it->count++;
+        } else {
+            ngrams.push_back(ngram);
+        }
+    }
+
+    // number of unique words is needed by Kneser-Ney continuation probability
+    std::unordered_set<std::string> uniqueTokens(tokens.begin(), tokens.end());
+    smoothNGrams(ngrams, n, smoothingType, uniqueTokens.size());
+
+    return ngrams;
+}
+
+
+// same estimates as smoothNGrams, computed with parallel passes over histories of a model sorted by packed key
+// (history sizes vary a lot, so histories are scheduled with work stealing)
+void smoothColumnarModel(ColumnarModel &model, SmoothingType smoothingType, size_t vocabularySize, size_t grainSize = 1024) {
+    const double numUniqueWords = static_cast<double>(vocabularySize);
+    std::vector<size_t> boundaries = findHistoryBoundaries(model);
+    const size_t numHistories = boundaries.empty() ? 0 : boundaries.size() - 1;
+    model.probabilities.resize(model.counts.size());
+
+    // number of histories with the same number of different following words
+    std::unordered_map<int, int> eachOccurrences;
+    std::mutex mutex;
+    parallelForStealing(numHistories, grainSize, [&](size_t begin, size_t end) {
+        std::unordered_map<int, int> localOccurrences;
+        for (size_t h = begin; h < end; ++h) {
+            localOccurrences[static_cast<int>(boundaries[h + 1] - boundaries[h])]++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &[types, occurrences] : localOccurrences) {
+            eachOccurrences[types] += occurrences;
+        }
+    });
+    auto occurrencesOf = [&eachOccurrences](int c) {
+        auto it = eachOccurrences.find(c);
+        return (it != eachOccurrences.end()) ? static_cast<double>(it->second) : 0.0;
+    };
+
+    parallelForStealing(numHistories, grainSize, [&](size_t begin, size_t end) {
+        const int *counts = model.counts.data();
+        double *probabilities = model.probabilities.data();
+        for (size_t h = begin; h < end; ++h) {
+            const double n = static_cast<double>(boundaries[h + 1] - boundaries[h]);
+            for (size_t row = boundaries[h]; row < boundaries[h + 1]; ++row) {
+                if (smoothingType == GOOD_TURING) {
+                    double c = counts[row];
+                    double c_occurrences = occurrencesOf(counts[row]);
+                    double c1_occurrences = occurrencesOf(counts[row] + 1);
+                    probabilities[row] = (c_occurrences != 0 && c1_occurrences != 0)
+                            ? (c + 1) * c1_occurrences / c_occurrences / n
+                            : occurrencesOf(1) / n;
+                }
+                else {
+                    const double D = 0.5;
+                    double c = n + (counts[row] - 1);
+                    probabilities[row] = std::max(counts[row] - D, 0.0) / c + (D * n / c) * (n / numUniqueWords);
+                }
+            }
+        }
+    });
+}
+
+
+// columnar model from (key, count) pairs sorted by key, model takes over the vocabulary
+ColumnarModel columnarModelFromCounts(const std::vector<std::pair<uint64_t, int>> &sorted, Vocabulary vocabulary, int n) {
+    ColumnarModel model;
+    model.n = n;
+    model.vocabulary = std::move(vocabulary);
+    model.wordIds.assign(n, std::vector<uint32_t>(sorted.size()));
+    model.counts.resize(sorted.size());
+    model.probabilities.resize(sorted.size());
+
+    const uint64_t mask = (1ULL << WORD_ID_BITS) - 1;
+    for (size_t row = 0; row < sorted.size(); ++row) {
+        for (int i = 0; i < n; ++i) {
+            model.wordIds[i][row] = static_cast<uint32_t>((sorted[row].first >> (WORD_ID_BITS * (n - 1 - i))) & mask);
+        }
+        model.counts[row] = sorted[row].second;
+    }
+    return model;
+}
+
+
+std::vector<NGram> toNGrams(const ColumnarModel &model) {
+    std::vector<NGram> ngrams(model.counts.size());
+    parallelFor(ngrams.size(), [&](size_t begin, size_t end) {
+        for (size_t row = begin; row < end; ++row) {
+            ngrams[row].words.resize(model.n);
+            for (int i = 0; i < model.n; ++i) {
+                ngrams[row].words[i] = model.vocabulary.words[model.wordIds[i][row]];
+            }
+            ngrams[row].count = model.counts[row];
+            ngrams[row].probability = model.probabilities[row];
+        }
+    });
+    return ngrams;
+}
+
+
+// smoothed N-grams sorted by packed key from counts of packed keys
+template<typename NGramType>
+std::vector<NGramType> smoothCounts(std::vector<std::pair<uint64_t, int>> counts, Vocabulary vocabulary, int n, SmoothingType smoothingType) {
+    std::sort(counts.begin(), counts.end());
+    ColumnarModel model = columnarModelFromCounts(counts, std::move(vocabulary), n);
+    smoothColumnarModel(model, smoothingType, model.vocabulary.words.size());
+
+    std::vector<NGram> smoothed = toNGrams(model);
+    return {std::make_move_iterator(smoothed.begin()), std::make_move_iterator(smoothed.end())};
+}
+
+
+// Count-Min sketch with conservative update
+//
+// estimated count c' of an N-gram with true count c satisfies c <= c' <= c + epsilon * N with probability at least 1 - delta,
+// where N is number of all counted N-grams, epsilon = e / width and delta = e^(-depth)
+// --> relative error of a smoothed probability is bounded by epsilon * N / c, so only frequent N-grams are reliable
+struct CountMinSketch {
+    size_t width{};
+    size_t depth{};
+    std::vector<uint32_t> counters;
+};
+
+
+CountMinSketch createCountMinSketch(size_t width, size_t depth) {
+    CountMinSketch sketch;
+    sketch.width = width;
+    sketch.depth = depth;
+    sketch.counters.assign(width * depth, 0);
+    return sketch;
+}
+
+
+uint32_t estimateCount(const CountMinSketch &sketch, uint64_t keyHash) {
+    uint32_t estimate = UINT32_MAX;
+    for (size_t row = 0; row < sketch.depth; ++row) {
+        size_t column = mixHash(keyHash, row + 1) % sketch.width;
+        estimate = std::min(estimate, sketch.counters[row * sketch.width + column]);
+    }
+    return estimate;
+}
+
+
+// conservative update: only counters equal to the current minimum are incremented
+uint32_t addToSketch(CountMinSketch &sketch, uint64_t keyHash) {
+    uint32_t estimate = estimateCount(sketch, keyHash) + 1;
+    for (size_t row = 0; row < sketch.depth; ++row) {
+        uint32_t &counter = sketch.counters[row * sketch.width + mixHash(keyHash, row + 1) % sketch.width];
+        counter = std::max(counter, estimate);
+    }
+    return estimate;
+}
+
+
+struct ApproximateCountingOptions {
+    // sketch takes width * depth * 4 bytes
+    size_t width = 1 << 20;
+    size_t depth = 4;
+    // number of most frequent N-grams kept with their words
+    size_t heavyHitters = 100000;
+};
+
+
+// builds N-grams from sketch estimates, memory is bounded by sketch size and heavy hitter table
+// (plus the set of unique words needed by smoothing)
+template<typename NGramType>
+std::vector<NGramType> buildNGramsApproximate(const std::vector<std::string> &tokens, int n, SmoothingType smoothingType, const ApproximateCountingOptions &options) {
+    std::vector<NGramType> ngrams;
+    if (n < 2) {
+        std::cerr << "N-grams must have a minimum size of 2." << std::endl;
+        return ngrams;
+    }
+    if (tokens.size() < static_cast<size_t>(n)) {
+        return ngrams;
+    }
+
+    CountMinSketch sketch = createCountMinSketch(options.width, options.depth);
+    std::hash<std::string> hasher;
+
+    // heavy hitter table grows up to twice its capacity and is then cut back to the most frequent entries
+    std::unordered_map<std::string, uint32_t> heavyHitters;
+    uint32_t admissionThreshold = 0;
+
+    for (size_t i = 0; i < tokens.size() - (n - 1); ++i) {
+        std::string key = joinNGramKey(tokens, i, n);
+        uint32_t estimate = addToSketch(sketch, hasher(key));
+
+        auto it = heavyHitters.find(key);
+        if (it != heavyHitters.end()) {
+            it->second = estimate;
+        }
+        else if (estimate > admissionThreshold) {
+            heavyHitters.emplace(std::move(key), estimate);
+        }
+
+        if (heavyHitters.size() >= 2 * options.heavyHitters) {
+            // exactly the given number of entries is kept, ties in counts are broken by key so the cut is deterministic
+            std::vector<std::unordered_map<std::string, uint32_t>::iterator> entries;
+            entries.reserve(heavyHitters.size());
+            for (auto entry = heavyHitters.begin(); entry != heavyHitters.end(); ++entry) {
+                entries.push_back(entry);
+            }
+            auto moreFrequent = [](const auto &a, const auto &b) {
+                return a->second != b->second ? a->second > b->second : a->first < b->first;
+            };
+            std::nth_element(entries.begin(), entries.begin() + options.heavyHitters, entries.end(), moreFrequent);
+            admissionThreshold = entries[options.heavyHitters]->second;
+            for (size_t e = options.heavyHitters; e < entries.size(); ++e) {
+                heavyHitters.erase(entries[e]);
+            }
+        }
+    }
+
+    ngrams.reserve(heavyHitters.size());
+    for (const auto &[key, estimate] : heavyHitters) {
+        NGramType ngram;
+        std::istringstream iss(key);
+        std::string word;
+        // keys end every word with a space, so empty words can be restored as well
+        while (std::getline(iss, word, ' ')) {
+            ngram.words.push_back(word);
+        }
+        ngram.count = static_cast<int>(estimateCount(sketch, hasher(key)));
+        ngrams.push_back(std::move(ngram));
+    }
+
+    std::unordered_set<std::string> uniqueTokens(tokens.begin(), tokens.end());
+    smoothNGrams(ngrams, n, smoothingType, uniqueTokens.size());
+
+    return ngrams;
+}
+
+
+// bibliographic metadata of a corpus document (from its .odun.xml file)
+struct DocumentMetadata {
+    std::string documentId;
+    std::string title;
+    std::string abstract;
+    std::vector<std::string> keywords;
+    // faculty abbreviation, e.g. "UM FVV"
+    std::string publisher;
+    std::string faculty;
+    std::string typology;
+    int year{};
+    std::string textFileName;
+};
+
+
+// contents of all <tag>...</tag> elements, searched from given position
+std::vector<std::string> readXmlElements(const std::string &xml, const std::string &tag, size_t from = 0) {
+    std::vector<std::string> values;
+    const std::string open = "<" + tag + ">";
+    const std::string close = "</" + tag + ">";
+    for (size_t begin = xml.find(open, from); begin != std::string::npos; begin = xml.find(open, begin)) {
+        begin += open.size();
+        size_t end = xml.find(close, begin);
+        if (end == std::string::npos) {
+            break;
+        }
+        values.push_back(decodeXmlEntities(xml.substr(begin, end - begin)));
+        begin = end;
+    }
+    return values;
+}
+
+
+std::string readXmlElement(const std::string &xml, const std::string &tag) {
+    std::vector<std::string> values = readXmlElements(xml, tag);
+    return values.empty() ? "" : values.front();
+}
+
+
+DocumentMetadata readDocumentMetadata(const std::string &odunFileName) {
+    DocumentMetadata metadata;
+    std::ifstream odunFile(odunFileName);
+    if (!odunFile.is_open()) {
+        std::cerr << "Unable to open the file." << std::endl;
+        return metadata;
+    }
+
+    // metadata is at the top, the (large) embedded <PlainText> and <XmlText> after it are never read
+    std::string header;
+    std::string line;
+    while (std::getline(odunFile, line) && line.find("<PlainText") == std::string::npos
+           && line.find("<XmlText") == std::string::npos) {
+        header += line + "\n";
+    }
+
+    metadata.documentId = readXmlElement(header, "DocumentID");
+    metadata.title = readXmlElement(header, "Title");
+    metadata.abstract = readXmlElement(header, "Abstract");
+    size_t keywords = header.find("<Keywords>");
+    if (keywords != std::string::npos) {
+        metadata.keywords = readXmlElements(header.substr(keywords, header.find("</Keywords>", keywords) - keywords), "keyword");
+    }
+    metadata.publisher = readXmlElement(header, "EVSAbbreviation");
+    metadata.faculty = readXmlElement(header, "EVSName");
+    metadata.typology = readXmlElement(header, "Typology");
+    std::string year = readXmlElement(header, "IssueYear");
+    metadata.year = year.empty() ? 0 : std::atoi(year.c_str());
+
+    // kas-4000.odun.xml --> kas-4000.text.txt
+    std::string fileName = odunFileName.substr(0, odunFileName.rfind(".odun.xml"));
+    metadata.textFileName = fileName + ".text.txt";
+    return metadata;
+}
+
+
+// metadata of all documents in corpus directory
+std::vector<DocumentMetadata> buildMetadataIndex(const std::string &corpusDirectory) {
+    std::vector<DocumentMetadata> documents;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::directory_iterator(corpusDirectory, error)) {
+        std::string fileName = entry.path().string();
+        if (fileName.size() > 9 && fileName.compare(fileName.size() - 9, 9, ".odun.xml") == 0) {
+            documents.push_back(readDocumentMetadata(fileName));
+        }
+    }
+    if (error) {
+        std::cerr << "Unable to read corpus directory." << std::endl;
+    }
+    std::sort(documents.begin(), documents.end(), [](const DocumentMetadata &a, const DocumentMetadata &b) {
+        return a.textFileName < b.textFileName;
+    });
+    return documents;
+}
+
+
+// documents selected by predicate are used to train the model of the domain
+struct TrainingDomain {
+    std::string name;
+    std::function<bool(const DocumentMetadata&)> predicate;
+};
+
+
+// N-grams sorted by packed key from (key, count) pairs
+std::vector<NGram> countsToNGrams(std::vector<std::pair<uint64_t, int>> sorted, const Vocabulary &vocabulary, int n) {
+    std::sort(sorted.begin(), sorted.end());
+
+    const uint64_t mask = (1ULL << WORD_ID_BITS) - 1;
+    std::vector<NGram> ngrams;
+    ngrams.reserve(sorted.size());
+    for (const auto &[key, count] : sorted) {
+        NGram ngram;
+        ngram.words.resize(n);
+        for (int i = 0; i < n; ++i) {
+            ngram.words[i] = vocabulary.words[(key >> (WORD_ID_BITS * (n - 1 - i))) & mask];
+        }
+        ngram.count = count;
+        ngrams.push_back(std::move(ngram));
+    }
+    return ngrams;
+}
+
+
+std::vector<NGram> countsToNGrams(const std::unordered_map<uint64_t, int> &counts, const Vocabulary &vocabulary, int n) {
+    return countsToNGrams(std::vector<std::pair<uint64_t, int>>(counts.begin(), counts.end()), vocabulary, n);
+}
+
+
+// every document is read and tokenized once, its N-grams are counted for every domain it belongs to
+std::vector<std::vector<NGram>> buildDomainModels(const std::vector<DocumentMetadata> &documents, const std::vector<TrainingDomain> &domains, int n, SmoothingType smoothingType) {
+    std::vector<std::vector<NGram>> models(domains.size());
+    if (n < 2 || n > 64 / WORD_ID_BITS) {
+        std::cerr << "N-grams must have between 2 and " << 64 / WORD_ID_BITS << " words." << std::endl;
+        return models;
+    }
+
+    Vocabulary vocabulary;
+    std::vector<std::unordered_map<uint64_t, int>> counts(domains.size());
+    std::vector<std::unordered_set<uint32_t>> domainWords(domains.size());
+    std::vector<size_t> selected;
+    std::vector<uint32_t> ids;
+
+    for (const auto &document : documents) {
+        selected.clear();
+        for (size_t d = 0; d < domains.size(); ++d) {
+            if (domains[d].predicate(document)) {
+                selected.push_back(d);
+            }
+        }
+        if (selected.empty()) {
+            continue;
+        }
+
+        std::vector<std::string> tokens = preprocessAndTokenize(document.textFileName, false);
+        ids.clear();
+        for (const auto &token : tokens) {
+            ids.push_back(internWord(vocabulary, token));
+        }
+        if (vocabulary.words.size() > MAX_VOCABULARY_SIZE) {
+            std::cerr << "Vocabulary is too large for packed N-gram keys." << std::endl;
+            return models;
+        }
+
+        for (size_t i = 0; i + n <= ids.size(); ++i) {
+            uint64_t key = packNGramKey(&ids[i], n);
+            for (size_t d : selected) {
+                counts[d][key]++;
+            }
+        }
+        for (size_t d : selected) {
+            domainWords[d].insert(ids.begin(), ids.end());
+        }
+    }
+
+    for (size_t d = 0; d < domains.size(); ++d) {
+        models[d] = countsToNGrams(counts[d], vocabulary, n);
+        smoothNGrams(models[d], n, smoothingType, domainWords[d].size());
+    }
+    return models;
+}
+
+
+// blocking queue with fixed capacity between two pipeline stages
+template<typename T>
+struct BoundedQueue {
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    // blocks while queue is full
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    // blocks while queue is empty, returns false once queue is closed and drained
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop();
+        notFull.notify_one();
+        return true;
+    }
+
+    // producer is done
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::queue<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+
+// training as three concurrent stages connected by bounded queues:
+// reading blocks of lines --> sentence splitting, tokenization and interning --> counting packed N-gram keys
+//
+// only a few chunks are in flight at once, so the whole token vector is never held in memory
+// N-grams continue across chunks and files, so counts are the same as buildNGrams on concatenated tokens
+template<typename NGramType>
+std::vector<NGramType> buildNGramsPipelined(const std::vector<std::string> &fileNames, int n, SmoothingType smoothingType,
+                                            size_t blocksPerChunk = 256, size_t queueCapacity = 8) {
+    std::vector<NGramType> ngrams;
+    if (n < 2 || n > 64 / WORD_ID_BITS) {
+        std::cerr << "N-grams must have between 2 and " << 64 / WORD_ID_BITS << " words." << std::endl;
+        return ngrams;
+    }
+
+    BoundedQueue<std::vector<std::string>> blockQueue(queueCapacity);
+    BoundedQueue<std::vector<uint32_t>> idQueue(queueCapacity);
+
+    // blocks are separated by blank lines, sentences never cross them
+    std::thread reader([&]() {
+        std::vector<std::string> chunk;
+        for (const auto &fileName : fileNames) {
+            std::ifstream corpusFile(fileName);
+            if (!corpusFile.is_open()) {
+                std::cerr << "Unable to open the file." << std::endl;
+                continue;
+            }
+            std::string line;
+            std::string block;
+            while (std::getline(corpusFile, line)) {
+                if (std::all_of(line.begin(), line.end(), [](unsigned char c) { return std::isspace(c); })) {
+                    chunk.push_back(std::move(block));
+                    block.clear();
+                    if (chunk.size() >= blocksPerChunk) {
+                        blockQueue.push(std::move(chunk));
+                        chunk.clear();
+                    }
+                    continue;
+                }
+                if (!block.empty()) {
+                    block += ' ';
+                }
+                block += line;
+            }
+            chunk.push_back(std::move(block));
+        }
+        if (!chunk.empty()) {
+            blockQueue.push(std::move(chunk));
+        }
+        blockQueue.close();
+    });
+
+    // vocabulary is only touched by this stage until all threads are joined
+    Vocabulary vocabulary;
+    bool vocabularyOverflow = false;
+    std::thread tokenizer([&]() {
+        std::vector<std::string> chunk;
+        std::vector<std::string> tokens;
+        while (blockQueue.pop(chunk)) {
+            tokens.clear();
+            for (const auto &block : chunk) {
+                appendSentenceTokens(block, tokens);
+            }
+            std::vector<uint32_t> ids;
+            ids.reserve(tokens.size());
+            for (const auto &token : tokens) {
+                ids.push_back(internWord(vocabulary, token));
+            }
+            vocabularyOverflow |= vocabulary.words.size() > MAX_VOCABULARY_SIZE;
+            idQueue.push(std::move(ids));
+        }
+        idQueue.close();
+    });
+
+    // counting runs on this thread, last N-1 IDs of a batch are carried over to the next one
+    std::unordered_map<uint64_t, int> counts;
+    std::vector<uint32_t> window;
+    std::vector<uint32_t> ids;
+    while (idQueue.pop(ids)) {
+        window.insert(window.end(), ids.begin(), ids.end());
+        for (size_t i = 0; i + n <= window.size(); ++i) {
+            counts[packNGramKey(&window[i], n)]++;
+        }
+        if (window.size() >= static_cast<size_t>(n - 1)) {
+            window.erase(window.begin(), window.end() - (n - 1));
+        }
+    }
+
+    reader.join();
+    tokenizer.join();
+    if (vocabularyOverflow) {
+        std::cerr << "Vocabulary is too large for packed N-gram keys." << std::endl;
+        return ngrams;
+    }
+
+    return smoothCounts<NGramType>({counts.begin(), counts.end()}, std::move(vocabulary), n, smoothingType);
+}
+
+
+// count table shared by counting threads without a global lock
+//
+// keys are split into shards by the high bits of their hash, every shard is an open addressing table with linear probing
+// a slot is claimed with compare-and-swap on its key and counted with an atomic add
+// tables do not grow while counting, capacity comes from an estimate of distinct keys and a shard refuses new keys
+// above 3/4 load, so the caller can count again with a larger counter
+struct ConcurrentCounter {
+    struct Shard {
+        // stored key is packed key + 1, 0 marks an empty slot (packed keys use at most 63 bits)
+        std::vector<std::atomic<uint64_t>> keys;
+        std::vector<std::atomic<int>> counts;
+        size_t mask{};
+        size_t maxKeys{};
+    };
+
+    int shardBits{};
+    std::vector<Shard> shards;
+    // claimed slots of every shard
+    std::vector<std::atomic<size_t>> sizes;
+};
+
+
+ConcurrentCounter createConcurrentCounter(size_t expectedKeys, int shardBits = 6) {
+    ConcurrentCounter counter;
+    counter.shardBits = shardBits;
+    counter.shards.resize(size_t(1) << shardBits);
+    counter.sizes = std::vector<std::atomic<size_t>>(counter.shards.size());
+
+    // expected load factor is below 1/2, so a shard can take 1.5 times its share of keys before it is full
+    size_t capacity = 64;
+    while (capacity < 2 * (expectedKeys >> shardBits) + 64) {
+        capacity *= 2;
+    }
+    for (auto &shard : counter.shards) {
+        shard.keys = std::vector<std::atomic<uint64_t>>(capacity);
+        shard.counts = std::vector<std::atomic<int>>(capacity);
+        shard.mask = capacity - 1;
+        shard.maxKeys = capacity / 4 * 3;
+    }
+    return counter;
+}
+
+
+// returns false if the key is new and its shard is full
+bool addCount(ConcurrentCounter &counter, uint64_t key, int count) {
+    uint64_t hash = mixHash(key, 0);
+    size_t shardIndex = hash >> (64 - counter.shardBits);
+    auto &shard = counter.shards[shardIndex];
+    uint64_t stored = key + 1;
+
+    size_t slot = hash & shard.mask;
+    for (size_t probe = 0; probe <= shard.mask; ++probe) {
+        uint64_t current = shard.keys[slot].load(std::memory_order_acquire);
+        if (current == 0) {
+            // reserve room for the key before claiming a slot
+            if (counter.sizes[shardIndex].fetch_add(1, std::memory_order_relaxed) >= shard.maxKeys) {
+                counter.sizes[shardIndex].fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (shard.keys[slot].compare_exchange_strong(current, stored, std::memory_order_acq_rel)) {
+                current = stored;
+            }
+            else {
+                counter.sizes[shardIndex].fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        if (current == stored) {
+            shard.counts[slot].fetch_add(count, std::memory_order_relaxed);
+            return true;
+        }
+        slot = (slot + 1) & shard.mask;
+    }
+    return false;
+}
+
+
+// number of distinct N-grams estimated from the k smallest key hashes (k minimum values sketch, error about 1/sqrt(k))
+size_t estimateDistinctKeys(const std::vector<uint32_t> &ids, int n, size_t k = 4096) {
+    size_t numPositions = ids.size() - (n - 1);
+    std::mutex mutex;
+    std::set<uint64_t> smallest;
+    parallelFor(numPositions, [&](size_t begin, size_t end) {
+        std::set<uint64_t> local;
+        for (size_t i = begin; i < end; ++i) {
+            uint64_t hash = mixHash(packNGramKey(&ids[i], n), 0);
+            if (local.size() < k || hash < *local.rbegin()) {
+                local.insert(hash);
+                if (local.size() > k) {
+                    local.erase(std::prev(local.end()));
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        smallest.insert(local.begin(), local.end());
+    });
+
+    if (smallest.size() < k) {
+        return smallest.size();
+    }
+    uint64_t kth = *std::next(smallest.begin(), static_cast<std::ptrdiff_t>(k - 1));
+    double estimate = static_cast<double>(k - 1) / (static_cast<double>(kth) / 18446744073709551616.0);
+    return std::min(numPositions, static_cast<size_t>(estimate));
+}
+
+
+// only valid after all counting threads are joined
+std::vector<std::pair<uint64_t, int>> collectCounts(const ConcurrentCounter &counter) {
+    std::vector<std::pair<uint64_t, int>> counts;
+    for (const auto &shard : counter.shards) {
+        for (size_t slot = 0; slot <= shard.mask; ++slot) {
+            uint64_t stored = shard.keys[slot].load(std::memory_order_relaxed);
+            if (stored != 0) {
+                counts.emplace_back(stored - 1, shard.counts[slot].load(std::memory_order_relaxed));
+            }
+        }
+    }
+    return counts;
+}
+
+
+// counts N-grams on all cores, every thread takes a contiguous range of N-gram positions
+// repeated N-grams are first summed in a small per-thread buffer, which is flushed into the shared counter in batches
+// gives the same counts and probabilities as buildNGrams
+template<typename NGramType>
+std::vector<NGramType> buildNGramsParallel(const std::vector<std::string> &tokens, int n, SmoothingType smoothingType, size_t flushSize = 4096) {
+    std::vector<NGramType> ngrams;
+    if (n < 2 || n > 64 / WORD_ID_BITS) {
+        std::cerr << "N-grams must have between 2 and " << 64 / WORD_ID_BITS << " words." << std::endl;
+        return ngrams;
+    }
+    if (tokens.size() < static_cast<size_t>(n)) {
+        return ngrams;
+    }
+
+    Vocabulary vocabulary;
+    std::vector<uint32_t> ids;
+    ids.reserve(tokens.size());
+    for (const auto &token : tokens) {
+        ids.push_back(internWord(vocabulary, token));
+    }
+    if (vocabulary.words.size() > MAX_VOCABULARY_SIZE) {
+        std::cerr << "Vocabulary is too large for packed N-gram keys." << std::endl;
+        return ngrams;
+    }
+
+    // counter is sized from estimated distinct keys instead of positions, if a shard fills up counting starts over with twice the size
+    size_t numPositions = ids.size() - (n - 1);
+    size_t expectedKeys = estimateDistinctKeys(ids, n);
+    ConcurrentCounter counter;
+    std::atomic<bool> overflow = true;
+    while (overflow) {
+        counter = createConcurrentCounter(expectedKeys);
+        overflow = false;
+        parallelFor(numPositions, [&](size_t begin, size_t end) {
+            std::unordered_map<uint64_t, int> buffer;
+            auto flush = [&]() {
+                for (const auto &[key, count] : buffer) {
+                    if (!addCount(counter, key, count)) {
+                        overflow = true;
+                    }
+                }
+                buffer.clear();
+            };
+
+            for (size_t i = begin; i < end && !overflow; ++i) {
+                buffer[packNGramKey(&ids[i], n)]++;
+                if (buffer.size() >= flushSize) {
+                    flush();
+                }
+            }
+            flush();
+        });
+        expectedKeys *= 2;
+    }
+
+    return smoothCounts<NGramType>(collectCounts(counter), std::move(vocabulary), n, smoothingType);
+}
+
+
+// build by sorting instead of hashing: keys of all N-gram positions are materialised, sorted in parallel and run-length counted
+// sort passes stream through memory instead of probing a growing hash table, and rows come out in packed key order,
+// so model is ready for history-grouped smoothing and the binary format
+ColumnarModel buildColumnarModelSorted(const std::vector<std::string> &tokens, int n, SmoothingType smoothingType) {
+    if (n < 2 || n > 64 / WORD_ID_BITS) {
+        std::cerr << "N-grams must have between 2 and " << 64 / WORD_ID_BITS << " words." << std::endl;
+        return {};
+    }
+
+    Vocabulary vocabulary;
+    std::vector<uint32_t> ids;
+    ids.reserve(tokens.size());
+    for (const auto &token : tokens) {
+        ids.push_back(internWord(vocabulary, token));
+    }
+    if (vocabulary.words.size() > MAX_VOCABULARY_SIZE) {
+        std::cerr << "Vocabulary is too large for packed N-gram keys." << std::endl;
+        return {};
+    }
+
+    size_t numPositions = (ids.size() >= static_cast<size_t>(n)) ? ids.size() - (n - 1) : 0;
+    std::vector<uint64_t> keys(numPositions);
+    parallelFor(numPositions, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            keys[i] = packNGramKey(&ids[i], n);
+        }
+    });
+    std::sort(std::execution::par_unseq, keys.begin(), keys.end());
+
+    std::vector<std::pair<uint64_t, int>> counts;
+    for (size_t i = 0; i < keys.size();) {
+        size_t run = i + 1;
+        while (run < keys.size() && keys[run] == keys[i]) {
+            ++run;
+        }
+        counts.emplace_back(keys[i], static_cast<int>(run - i));
+        i = run;
+    }
+
+    ColumnarModel model = columnarModelFromCounts(counts, std::move(vocabulary), n);
+    smoothColumnarModel(model, smoothingType, model.vocabulary.words.size());
+    return model;
+}
+
+
+void printNGrams(const std::vector<NGram>& ngrams) {
+    for (const auto &ngram: ngrams) {
+        std::cout << "(";
+        for (const auto& word : ngram.words) {
+            std::cout << word << ", ";
+        }
+        std::cout << "\b\b): " << ngram.count << " (" << ngram.probability << ")\n";
+    }
+}
+
+
+// N-grams with the same history next to each other, most probable continuation first
+bool historyOrder(const NGram &a, const NGram &b) {
+    if (!std::equal(a.words.begin(), a.words.end() - 1, b.words.begin(), b.words.end() - 1)) {
+        return std::lexicographical_compare(a.words.begin(), a.words.end() - 1, b.words.begin(), b.words.end() - 1);
+    }
+    return a.probability > b.probability;
+}
+
+
+// blocked Bloom filter over N-gram keys, all bits of a key are in the same 64-byte block (one cache line)
+struct BloomFilter {
+    uint64_t numBlocks{};
+    uint32_t numHashes{};
+    // fingerprint of the set of N-grams the filter was built from
+    uint64_t modelFingerprint{};
+    std::vector<uint64_t> bits;
+};
+
+
+const uint32_t BLOOM_FILTER_MAGIC = 0x4d4f4c42;   // "BLOM"
+const uint32_t BLOOM_FILTER_VERSION = 2;
+
+
+const size_t BLOOM_BLOCK_WORDS = 8;
+
+
+BloomFilter createBloomFilter(size_t numKeys, double bitsPerKey) {
+    BloomFilter filter;
+    filter.numBlocks = std::max<uint64_t>(1, static_cast<uint64_t>(numKeys * bitsPerKey / 512.0) + 1);
+    filter.numHashes = std::max(1, static_cast<int>(std::round(bitsPerKey * std::log(2.0))));
+    filter.bits.assign(filter.numBlocks * BLOOM_BLOCK_WORDS, 0);
+    return filter;
+}
+
+
+void addToBloomFilter(BloomFilter &filter, const std::string &key) {
+    uint64_t keyHash = hashString(key);
+    // order independent, so the same model read back in any order gives the same fingerprint
+    filter.modelFingerprint += mixHash(keyHash, 6);
+    uint64_t *block = &filter.bits[(mixHash(keyHash, 0) % filter.numBlocks) * BLOOM_BLOCK_WORDS];
+    for (uint32_t i = 0; i < filter.numHashes; ++i) {
+        uint64_t bit = mixHash(keyHash, i + 1) & 511;
+        block[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+
+BloomFilter buildBloomFilter(const std::vector<NGram> &ngrams, double bitsPerKey) {
+    BloomFilter filter = createBloomFilter(ngrams.size(), bitsPerKey);
+    for (const auto &ngram : ngrams) {
+        if (!ngram.words.empty()) {
+            addToBloomFilter(filter, joinNGramKey(ngram.words, 0, ngram.words.size()));
+        }
+    }
+    return filter;
+}
+
+
+// same fingerprint as stored in Bloom filter built from the model
+uint64_t bloomModelFingerprint(const std::vector<NGram> &ngrams) {
+    uint64_t fingerprint = 0;
+    for (const auto &ngram : ngrams) {
+        if (!ngram.words.empty()) {
+            fingerprint += mixHash(hashString(joinNGramKey(ngram.words, 0, ngram.words.size())), 6);
+        }
+    }
+    return fingerprint;
+}
+
+
+// false means the key is certainly not in the model (empty filter never rejects)
+bool mayContain(const BloomFilter &filter, const std::string &key) {
+    if (filter.numBlocks == 0) {
+        return true;
+    }
+    uint64_t keyHash = hashString(key);
+    const uint64_t *block = &filter.bits[(mixHash(keyHash, 0) % filter.numBlocks) * BLOOM_BLOCK_WORDS];
+    for (uint32_t i = 0; i < filter.numHashes; ++i) {
+        uint64_t bit = mixHash(keyHash, i + 1) & 511;
+        if ((block[bit >> 6] & (1ULL << (bit & 63))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void saveBloomFilter(const BloomFilter &filter, const std::string &fileName) {
+    std::ofstream outFile(fileName, std::ios::binary);
+    if (!outFile.is_open()) {
+        std::cerr << "Unable to open the file for writing." << std::endl;
+        return;
+    }
+    uint32_t header[2] = {BLOOM_FILTER_MAGIC, BLOOM_FILTER_VERSION};
+    outFile.write(reinterpret_cast<const char*>(header), sizeof(header));
+    outFile.write(reinterpret_cast<const char*>(&filter.modelFingerprint), sizeof(filter.modelFingerprint));
+    outFile.write(reinterpret_cast<const char*>(&filter.numBlocks), sizeof(filter.numBlocks));
+    outFile.write(reinterpret_cast<const char*>(&filter.numHashes), sizeof(filter.numHashes));
+    outFile.write(reinterpret_cast<const char*>(filter.bits.data()), static_cast<std::streamsize>(filter.bits.size() * sizeof(uint64_t)));
+}
+
+
+// filter that does not belong to the model with given fingerprint is not used (empty filter never rejects)
+BloomFilter readBloomFilter(const std::string &fileName, uint64_t modelFingerprint) {
+    BloomFilter filter;
+    std::ifstream inFile(fileName, std::ios::binary);
+    if (!inFile.is_open()) {
+        std::cerr << "Unable to open the file." << std::endl;
+        return filter;
+    }
+    uint32_t header[2] = {};
+    inFile.read(reinterpret_cast<char*>(header), sizeof(header));
+    inFile.read(reinterpret_cast<char*>(&filter.modelFingerprint), sizeof(filter.modelFingerprint));
+    if (!inFile || header[0] != BLOOM_FILTER_MAGIC || header[1] != BLOOM_FILTER_VERSION) {
+        std::cerr << "Not a Bloom filter file." << std::endl;
+        return {};
+    }
+    if (filter.modelFingerprint != modelFingerprint) {
+        std::cerr << "Bloom filter does not belong to the model." << std::endl;
+        return {};
+    }
+    inFile.read(reinterpret_cast<char*>(&filter.numBlocks), sizeof(filter.numBlocks));
+    inFile.read(reinterpret_cast<char*>(&filter.numHashes), sizeof(filter.numHashes));
+    // size is checked against file size before anything is allocated
+    std::error_code error;
+    uint64_t fileSize = std::filesystem::file_size(fileName, error);
+    if (!inFile || error || filter.numBlocks == 0 || filter.numBlocks > fileSize / (BLOOM_BLOCK_WORDS * sizeof(uint64_t))) {
+        std::cerr << "Corrupted Bloom filter file." << std::endl;
+        return {};
+    }
+    filter.bits.resize(filter.numBlocks * BLOOM_BLOCK_WORDS);
+    inFile.read(reinterpret_cast<char*>(filter.bits.data()), static_cast<std::streamsize>(filter.bits.size() * sizeof(uint64_t)));
+    if (!inFile) {
+        std::cerr << "Corrupted Bloom filter file." << std::endl;
+        return {};
+    }
+    return filter;
+}
 
 
 void saveModelToFile(const std::vector<NGram>& ngrams, const std::string& fileName) {
@@ -326,152 +1847,2287 @@ void saveModelToFile(const std::vector<NGram>& ngrams, const std::string& fileNa
         return;
     }
 
-    for (const auto &ngram : ngrams) {
-        for (const auto &word : ngram.words) {
-            outFile << word << " ";
+    // model is written sorted by history so next word candidates can be read without sorting
+    std::vector<const NGram*> sorted;
+    sorted.reserve(ngrams.size());
+    for (const auto &ngram : ngrams) {
+        if (!ngram.words.empty()) {
+            sorted.push_back(&ngram);
+        }
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const NGram *a, const NGram *b) { return historyOrder(*a, *b); });
+
+    for (const NGram *ngramPointer : sorted) {
+        const NGram &ngram = *ngramPointer;
+        for (const auto &word : ngram.words) {
+            outFile << word << " ";
+        }
+        outFile << ngram.count << " " << ngram.probability << "\n";
+    }
+
+    outFile.close();
+
+    // Bloom filter for fast rejection of unseen N-grams is stored next to the model
+    saveBloomFilter(buildBloomFilter(ngrams, 10.0), fileName + ".bloom");
+}
+
+
+std::vector<NGram> readModel(const std::string &fileName, int n) {
+    // open file
+    std::vector<NGram> ngrams;
+    std::ifstream inFile(fileName);
+    if (!inFile.is_open()) {
+        std::cerr << "Unable to open the file for writing." << std::endl;
+        return ngrams;
+    }
+
+    std::string line;
+    while(std::getline(inFile, line)) {
+        std::istringstream iss(line);
+        std::string token;
+        NGram ngram;
+
+        int words = 0;
+        // read words
+        while (iss >> token && words < n) {
+            ngram.words.push_back(token);
+            words++;
+        }
+
+        // read count
+        ngram.count = std::stoi(token);
+
+
+        // read probability
+        iss >> token;
+        ngram.probability = std::stod(token);
+
+        ngrams.push_back(ngram);
+    }
+
+    return ngrams;
+}
+
+
+std::vector<NGram> createTestNgrams(std::vector<NGram>& model, std::vector<std::string>& testTokens, int n) {
+    std::vector<NGram> testNgrams;
+    for (size_t i = 0; i < testTokens.size() - (n - 1); ++i) {
+        NGram ngram;
+        for (int j = 0; j < n; ++j) {
+            ngram.words.push_back(testTokens[i + j]);
+        }
+        ngram.count = 0;
+        ngram.probability = 0.0;
+        testNgrams.push_back(ngram);
+    }
+
+    // assign matching probabilities from already-built 2-gram model
+    for (auto &testNgram : testNgrams) {
+        for (const auto &ngram: model) {
+            int matches = 0;
+            for (int i = 0; i < n; ++i) {
+                if (testNgram.words[i] == ngram.words[i]) {
+                    matches++;
+                }
+            }
+            // 2-gram found in model
+            if (matches == n) {
+                testNgram.probability = ngram.probability;
+                break;
+            }
+            else {
+                testNgram.probability = static_cast<double>(1) / static_cast<double>(model.size());
+            }
+        }
+    }
+
+    return testNgrams;
+}
+
+
+double calculateSentenceProbability(std::vector<NGram>& testNgrams) {
+    double probability = 1.0;
+    for (const auto& ngram : testNgrams) {
+        probability *= ngram.probability;
+    }
+    return probability;
+}
+
+
+double calculateModelPerplexity(const std::vector<NGram> &model) {
+    // sum logarithms instead of multiplying powers, product of many small probabilities underflows
+    double logSum = 0.0;
+    for (const auto &ngram: model) {
+        logSum += std::log(ngram.probability);
+    }
+    return std::exp(-logSum / static_cast<double>(model.size()));
+}
+
+
+struct ModelStatistics {
+    size_t numNGrams{};
+    size_t numHistories{};
+    // cross entropy of training counts in bits per N-gram and perplexity 2^entropy from the same sum
+    double entropy{};
+    double perplexity{};
+    // N-grams with probability 0 (possible with Good-Turing fallback), left out of entropy
+    size_t numZeroProbabilities{};
+    double minHistoryMass{};
+    double maxHistoryMass{};
+    // histories whose probabilities do not sum to one (within tolerance)
+    size_t numDenormalisedHistories{};
+    // countOfCounts[c] = number of N-grams seen c times, last bucket collects all larger counts
+    std::vector<size_t> countOfCounts;
+};
+
+
+// all model statistics from tight loops over the columns (model must be sorted by packed key)
+ModelStatistics calculateModelStatistics(const ColumnarModel &model, double tolerance = 1e-3, size_t maxCount = 10) {
+    ModelStatistics statistics;
+    const size_t size = model.probabilities.size();
+    statistics.numNGrams = size;
+    statistics.countOfCounts.assign(maxCount + 1, 0);
+    if (size == 0) {
+        return statistics;
+    }
+    const double *probabilities = model.probabilities.data();
+    const int *counts = model.counts.data();
+
+    double weightedLogSum = std::transform_reduce(std::execution::unseq, probabilities, probabilities + size, counts,
+                                                  0.0, std::plus<>(), [](double p, int c) { return (p > 0.0) ? c * std::log2(p) : 0.0; });
+    double totalCount = std::transform_reduce(std::execution::unseq, probabilities, probabilities + size, counts,
+                                              0.0, std::plus<>(), [](double p, int c) { return (p > 0.0) ? c : 0.0; });
+    statistics.numZeroProbabilities = std::count_if(probabilities, probabilities + size, [](double p) { return !(p > 0.0); });
+    statistics.entropy = (totalCount > 0.0) ? -weightedLogSum / totalCount : 0.0;
+    statistics.perplexity = std::exp2(statistics.entropy);
+
+    for (size_t row = 0; row < size; ++row) {
+        statistics.countOfCounts[std::min(static_cast<size_t>(std::max(counts[row], 0)), maxCount)]++;
+    }
+
+    std::vector<double> masses = calculateHistoryMasses(model, findHistoryBoundaries(model));
+    statistics.numHistories = masses.size();
+    statistics.minHistoryMass = std::numeric_limits<double>::max();
+    statistics.maxHistoryMass = 0.0;
+    for (double mass : masses) {
+        statistics.minHistoryMass = std::min(statistics.minHistoryMass, mass);
+        statistics.maxHistoryMass = std::max(statistics.maxHistoryMass, mass);
+        statistics.numDenormalisedHistories += std::abs(mass - 1.0) > tolerance;
+    }
+    return statistics;
+}
+
+
+struct NormalisationReport {
+    size_t numHistories{};
+    // histories with more than all probability mass (broken smoothing)
+    size_t numOverfull{};
+    // histories that leave more mass than tolerance to unseen words
+    size_t numUnderfull{};
+    double maxDeviation{};
+    // histories with largest deviation (history words, probability mass)
+    std::vector<std::pair<std::string, double>> worstHistories;
+};
+
+
+// finds histories whose probability mass is not one (model must be sorted by packed key)
+NormalisationReport verifyNormalisation(const ColumnarModel &model, double tolerance, size_t numWorst = 10) {
+    std::vector<size_t> boundaries = findHistoryBoundaries(model);
+    std::vector<double> masses = calculateHistoryMasses(model, boundaries);
+
+    NormalisationReport report;
+    report.numHistories = masses.size();
+    std::vector<std::pair<size_t, double>> worst;
+    auto byDeviation = [](const std::pair<size_t, double> &a, const std::pair<size_t, double> &b) {
+        return std::abs(a.second - 1.0) > std::abs(b.second - 1.0);
+    };
+    for (size_t h = 0; h < masses.size(); ++h) {
+        report.numOverfull += masses[h] > 1.0 + tolerance;
+        report.numUnderfull += masses[h] < 1.0 - tolerance;
+        if (std::abs(masses[h] - 1.0) > tolerance) {
+            worst.emplace_back(h, masses[h]);
+        }
+    }
+
+    size_t numKept = std::min(worst.size(), numWorst);
+    std::partial_sort(worst.begin(), worst.begin() + numKept, worst.end(), byDeviation);
+    worst.resize(numKept);
+    for (const auto &[h, mass] : worst) {
+        std::string history;
+        for (int i = 0; i < model.n - 1; ++i) {
+            history += model.vocabulary.words[model.wordIds[i][boundaries[h]]] + " ";
+        }
+        report.worstHistories.emplace_back(history, mass);
+    }
+    report.maxDeviation = worst.empty() ? 0.0 : std::abs(worst.front().second - 1.0);
+    return report;
+}
+
+
+void printNormalisationReport(const NormalisationReport &report) {
+    std::cout << std::endl << "normalization check of " << report.numHistories << " histories:" << std::endl;
+    std::cout << "more than all probability mass: " << report.numOverfull << std::endl;
+    std::cout << "mass left for unseen words: " << report.numUnderfull << std::endl;
+    std::cout << "largest deviation: " << report.maxDeviation << std::endl;
+    for (const auto &[history, mass] : report.worstHistories) {
+        std::cout << "(" << history << "\b): " << mass << std::endl;
+    }
+}
+
+
+void printModelStatistics(const ModelStatistics &statistics) {
+    std::cout << std::endl << "model statistics:" << std::endl;
+    std::cout << "N-grams: " << statistics.numNGrams << ", histories: " << statistics.numHistories << std::endl;
+    std::cout << "entropy: " << statistics.entropy << " bits, perplexity: " << statistics.perplexity;
+    if (statistics.numZeroProbabilities > 0) {
+        std::cout << " (" << statistics.numZeroProbabilities << " N-grams with probability 0 left out)";
+    }
+    std::cout << std::endl;
+    std::cout << "probability mass per history: " << statistics.minHistoryMass << " - " << statistics.maxHistoryMass
+              << " (" << statistics.numDenormalisedHistories << " histories not normalized)" << std::endl;
+    std::cout << "count of counts:";
+    for (size_t c = 1; c < statistics.countOfCounts.size(); ++c) {
+        std::cout << " " << c << (c + 1 == statistics.countOfCounts.size() ? "+" : "") << ":" << statistics.countOfCounts[c];
+    }
+    std::cout << std::endl;
+}
+
+
+// with a Bloom filter, unseen N-grams are rejected without scanning the model
+double calculatePerplexity(const std::vector<NGram> &model, std::vector<std::string>& testTokens, int n, const BloomFilter *filter = nullptr) {
+    // Good Turing for zero frequency tokens (not yet seen tokens) --> c* / N
+    const unsigned int N = model.size();
+    const double c_asterisk = 1.0;
+    const double unseenProbability = c_asterisk / N;
+
+    // acquire words for N-grams from vector of test tokens
+    std::vector<double> probabilities;
+    for (size_t i = 0; i < testTokens.size() - (n - 1); ++i) {
+        if (filter != nullptr && !mayContain(*filter, joinNGramKey(testTokens, i, n))) {
+            probabilities.push_back(unseenProbability);
+            continue;
+        }
+
+        std::vector<std::string> words;
+        for (size_t j = 0; j < n; ++j) {
+            words.push_back(testTokens[i + j]);
+        }
+
+        // apply N-gram model to test tokens (words)
+        bool matchFound = false;
+        for (const auto &ngram : model) {
+            if (ngram.words.size() != words.size()) {
+                continue;
+            }
+            int matches = 0;
+            // find matches inside current N-gram
+            for (size_t k = 0; k < words.size(); ++k) {
+                if (ngram.words[k] == words[k]) {
+                    matches++;
+                }
+            }
+            // if match found
+            if (matches == n) {
+                probabilities.push_back(ngram.probability);
+                matchFound = true;
+                break;
+            }
+        }
+        if (!matchFound) {
+            probabilities.push_back(unseenProbability);
+        }
+    }
+
+    double perplexity = 1.0;
+    for (const auto &p : probabilities) {
+        double buffer = std::pow(p, -1 / static_cast<double>(testTokens.size()));
+        perplexity *= buffer;
+    }
+    return perplexity;
+}
+
+
+enum ModelLayout {
+    PERFECT_HASH,
+    EYTZINGER
+};
+
+
+// minimal perfect hash (PTHash style): key goes to a bucket, every bucket stores a pilot
+// that moves all of its keys to free slots --> slot = reduce(mix(hash(key) ^ hash(pilot)), numKeys)
+struct PerfectHash {
+    uint64_t numKeys{};
+    uint64_t numBuckets{};
+    // all key hashes depend on seed, a new seed is tried if no pilots are found for the current one
+    uint64_t seed{};
+    std::vector<uint32_t> pilots;
+};
+
+
+// average number of keys per bucket (pilots take 32 / 5 bits per key)
+const double PERFECT_HASH_BUCKET_SIZE = 5.0;
+const uint64_t PERFECT_HASH_MAX_SEEDS = 64;
+
+
+// maps 64-bit hash to [0, size) using all of its bits (plain % of a power of two would use only the lowest ones)
+uint64_t reduceHash(uint64_t hash, uint64_t size) {
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(hash) * size) >> 64);
+}
+
+
+uint64_t perfectHashBucket(const PerfectHash &perfectHash, uint64_t key) {
+    return reduceHash(mixHash(key, 2 * perfectHash.seed + 1), perfectHash.numBuckets);
+}
+
+
+uint64_t perfectHashKeyHash(const PerfectHash &perfectHash, uint64_t key) {
+    return mixHash(key, 2 * perfectHash.seed + 2);
+}
+
+
+// different key hashes give different mixed values for every pilot, so they can be separated by some pilot
+uint64_t perfectHashPilotSlot(const PerfectHash &perfectHash, uint64_t keyHash, uint32_t pilot) {
+    return reduceHash(mixHash(keyHash ^ mixHash(pilot, 0), 0), perfectHash.numKeys);
+}
+
+
+uint64_t perfectHashSlot(const PerfectHash &perfectHash, uint64_t key) {
+    uint32_t pilot = perfectHash.pilots[perfectHashBucket(perfectHash, key)];
+    return perfectHashPilotSlot(perfectHash, perfectHashKeyHash(perfectHash, key), pilot);
+}
+
+
+// pilots for a single seed, false if some bucket can not be placed
+bool findPilots(PerfectHash &perfectHash, const std::vector<uint64_t> &keys) {
+    std::vector<std::vector<uint64_t>> buckets(perfectHash.numBuckets);
+    for (uint64_t key : keys) {
+        buckets[perfectHashBucket(perfectHash, key)].push_back(perfectHashKeyHash(perfectHash, key));
+    }
+    // keys of a bucket with equal hashes land in the same slot with every pilot
+    for (auto &bucket : buckets) {
+        std::sort(bucket.begin(), bucket.end());
+        if (std::adjacent_find(bucket.begin(), bucket.end()) != bucket.end()) {
+            return false;
+        }
+    }
+
+    // largest buckets are placed first while there are still many free slots
+    std::vector<uint64_t> order(perfectHash.numBuckets);
+    for (uint64_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) { return buckets[a].size() > buckets[b].size(); });
+
+    // last buckets see only a few free slots and need about numKeys attempts on average
+    const uint64_t maxPilots = std::min<uint64_t>(UINT32_MAX, std::max<uint64_t>(1 << 16, 32 * perfectHash.numKeys));
+    std::vector<bool> taken(perfectHash.numKeys, false);
+    std::vector<uint64_t> slots;
+    for (uint64_t bucket : order) {
+        if (buckets[bucket].empty()) {
+            break;
+        }
+        bool placed = false;
+        for (uint64_t pilot = 0; pilot < maxPilots && !placed; ++pilot) {
+            slots.clear();
+            placed = true;
+            for (uint64_t keyHash : buckets[bucket]) {
+                uint64_t slot = perfectHashPilotSlot(perfectHash, keyHash, static_cast<uint32_t>(pilot));
+                if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+                    placed = false;
+                    break;
+                }
+                slots.push_back(slot);
+            }
+            if (placed) {
+                perfectHash.pilots[bucket] = static_cast<uint32_t>(pilot);
+                for (uint64_t slot : slots) {
+                    taken[slot] = true;
+                }
+            }
+        }
+        if (!placed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// keys must be unique, returns hash without pilots if no seed works
+PerfectHash buildPerfectHash(const std::vector<uint64_t> &keys) {
+    PerfectHash perfectHash;
+    perfectHash.numKeys = keys.size();
+    perfectHash.numBuckets = std::max<uint64_t>(1, static_cast<uint64_t>(keys.size() / PERFECT_HASH_BUCKET_SIZE));
+    for (perfectHash.seed = 0; perfectHash.seed < PERFECT_HASH_MAX_SEEDS; ++perfectHash.seed) {
+        perfectHash.pilots.assign(perfectHash.numBuckets, 0);
+        if (keys.empty() || findPilots(perfectHash, keys)) {
+            return perfectHash;
+        }
+    }
+    perfectHash.pilots.clear();
+    return perfectHash;
+}
+
+
+// fingerprint stored in every slot, rejects almost all keys that are not in the model before their words are compared
+uint16_t keyFingerprint(uint64_t key) {
+    return static_cast<uint16_t>(mixHash(key, 4) >> 48);
+}
+
+
+// immutable model with integer word IDs, stored column by column in the order given by its layout
+struct StaticModel {
+    ModelLayout layout = PERFECT_HASH;
+    ColumnarModel columns;
+    PerfectHash perfectHash;
+    std::vector<uint16_t> fingerprints;
+    // sorted keys in BFS order of an implicit binary search tree (index 0 is unused, row of node k is k - 1)
+    std::vector<uint64_t> eytzingerKeys;
+};
+
+
+// fills BFS ordered tree from sorted values with an in-order walk
+void fillEytzinger(const std::vector<size_t> &sorted, std::vector<size_t> &tree, size_t &next, size_t k) {
+    if (k < tree.size()) {
+        fillEytzinger(sorted, tree, next, 2 * k);
+        tree[k] = sorted[next++];
+        fillEytzinger(sorted, tree, next, 2 * k + 1);
+    }
+}
+
+
+// node of first key >= given key or 0 if all keys are smaller
+size_t eytzingerLowerBound(const std::vector<uint64_t> &keys, uint64_t key) {
+    const size_t size = keys.size();
+    const uint64_t *data = keys.data();
+    size_t k = 1;
+    while (k < size) {
+        // descendants four levels down share one cache line
+        __builtin_prefetch(data + std::min(16 * k, size - 1));
+        k = 2 * k + (data[k] < key);
+    }
+    // go back up to the last node where search went left
+    k >>= __builtin_ffsll(static_cast<long long>(~k));
+    return k;
+}
+
+
+// in-order successor of node k or 0 after the largest key
+size_t eytzingerNext(const std::vector<uint64_t> &keys, size_t k) {
+    if (2 * k + 1 < keys.size()) {
+        k = 2 * k + 1;
+        while (2 * k < keys.size()) {
+            k = 2 * k;
+        }
+        return k;
+    }
+    while (k & 1) {
+        k >>= 1;
+    }
+    return k >> 1;
+}
+
+
+// permutes rows of columnar model into the order of given layout and builds its index
+StaticModel createStaticModel(ColumnarModel columns, ModelLayout layout = PERFECT_HASH) {
+    StaticModel staticModel;
+    staticModel.layout = layout;
+
+    const size_t numRows = columns.probabilities.size();
+    std::vector<uint64_t> keys(numRows);
+    for (size_t i = 0; i < numRows; ++i) {
+        keys[i] = rowKey(columns, i);
+    }
+
+    if (layout == PERFECT_HASH) {
+        staticModel.perfectHash = buildPerfectHash(keys);
+        if (staticModel.perfectHash.pilots.empty()) {
+            std::cerr << "Unable to build perfect hash, sorted layout is used instead." << std::endl;
+            layout = EYTZINGER;
+            staticModel.layout = EYTZINGER;
+            staticModel.perfectHash = {};
+        }
+    }
+
+    // position of every row in the stored columns
+    std::vector<uint64_t> positions(numRows);
+    if (layout == PERFECT_HASH) {
+        // rows are stored in slot order of the perfect hash
+        staticModel.fingerprints.resize(numRows);
+        for (size_t i = 0; i < numRows; ++i) {
+            positions[i] = perfectHashSlot(staticModel.perfectHash, keys[i]);
+            staticModel.fingerprints[positions[i]] = keyFingerprint(keys[i]);
+        }
+    }
+    else {
+        // rows are stored in BFS order of sorted keys
+        std::vector<size_t> sorted(numRows);
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            sorted[i] = i;
+        }
+        std::sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+        std::vector<size_t> tree(numRows + 1);
+        size_t next = 0;
+        fillEytzinger(sorted, tree, next, 1);
+
+        staticModel.eytzingerKeys.resize(numRows + 1);
+        for (size_t k = 1; k < tree.size(); ++k) {
+            staticModel.eytzingerKeys[k] = keys[tree[k]];
+            positions[tree[k]] = k - 1;
+        }
+    }
+
+    staticModel.columns.n = columns.n;
+    staticModel.columns.vocabulary = std::move(columns.vocabulary);
+    staticModel.columns.wordIds.resize(columns.n);
+    for (int j = 0; j < columns.n; ++j) {
+        staticModel.columns.wordIds[j].resize(numRows);
+        for (size_t i = 0; i < numRows; ++i) {
+            staticModel.columns.wordIds[j][positions[i]] = columns.wordIds[j][i];
+        }
+    }
+    staticModel.columns.counts.resize(numRows);
+    staticModel.columns.probabilities.resize(numRows);
+    for (size_t i = 0; i < numRows; ++i) {
+        staticModel.columns.counts[positions[i]] = columns.counts[i];
+        staticModel.columns.probabilities[positions[i]] = columns.probabilities[i];
+    }
+    return staticModel;
+}
+
+
+StaticModel createStaticModel(const std::vector<NGram> &model, int n, ModelLayout layout = PERFECT_HASH) {
+    return createStaticModel(toColumnarModel(model, n), layout);
+}
+
+
+// row of packed key in model or -1 if key is not in model
+long findKey(const StaticModel &model, uint64_t key) {
+    if (model.columns.probabilities.empty()) {
+        return -1;
+    }
+    if (model.layout == EYTZINGER) {
+        size_t k = eytzingerLowerBound(model.eytzingerKeys, key);
+        return (k != 0 && model.eytzingerKeys[k] == key) ? static_cast<long>(k - 1) : -1;
+    }
+    uint64_t slot = perfectHashSlot(model.perfectHash, key);
+    if (model.fingerprints[slot] != keyFingerprint(key)) {
+        return -1;
+    }
+    return (rowKey(model.columns, slot) == key) ? static_cast<long>(slot) : -1;
+}
+
+
+// row of N-gram in model or -1 if N-gram is not in model
+long findNGram(const StaticModel &model, const uint32_t *ids) {
+    if (model.columns.probabilities.empty()) {
+        return -1;
+    }
+    for (int i = 0; i < model.columns.n; ++i) {
+        if (ids[i] == UNKNOWN_WORD) {
+            return -1;
+        }
+    }
+    return findKey(model, packNGramKey(ids, model.columns.n));
+}
+
+
+// keys of a batch are processed in blocks small enough that their prefetched cache lines are still there when needed
+const size_t LOOKUP_BLOCK_SIZE = 256;
+
+
+// rows of many packed keys at once (-1 for keys not in model)
+//
+// perfect hash layout is resolved in passes over a block of keys instead of key by key:
+// all bucket hashes are computed in one branch-free loop, then pilots of all buckets are prefetched,
+// then slots are computed and their fingerprints and word IDs prefetched, and only then are keys compared,
+// so memory latency of all keys in a block overlaps instead of adding up
+// (EYTZINGER layout searches key by key, every search already prefetches its own path)
+void lookupKeys(const StaticModel &model, const uint64_t *keys, size_t count, long *rows) {
+    if (model.layout == EYTZINGER || model.columns.probabilities.empty()) {
+        for (size_t i = 0; i < count; ++i) {
+            rows[i] = findKey(model, keys[i]);
+        }
+        return;
+    }
+
+    const PerfectHash &perfectHash = model.perfectHash;
+    uint64_t hashes[LOOKUP_BLOCK_SIZE];
+    uint64_t slots[LOOKUP_BLOCK_SIZE];
+    for (size_t blockBegin = 0; blockBegin < count; blockBegin += LOOKUP_BLOCK_SIZE) {
+        const size_t size = std::min(LOOKUP_BLOCK_SIZE, count - blockBegin);
+        const uint64_t *block = keys + blockBegin;
+
+        std::transform(std::execution::unseq, block, block + size, hashes,
+                       [&perfectHash](uint64_t key) { return perfectHashBucket(perfectHash, key); });
+        for (size_t i = 0; i < size; ++i) {
+            __builtin_prefetch(perfectHash.pilots.data() + hashes[i]);
+        }
+
+        for (size_t i = 0; i < size; ++i) {
+            slots[i] = perfectHashPilotSlot(perfectHash, perfectHashKeyHash(perfectHash, block[i]), perfectHash.pilots[hashes[i]]);
+            __builtin_prefetch(model.fingerprints.data() + slots[i]);
+            for (int j = 0; j < model.columns.n; ++j) {
+                __builtin_prefetch(model.columns.wordIds[j].data() + slots[i]);
+            }
+        }
+
+        for (size_t i = 0; i < size; ++i) {
+            bool found = model.fingerprints[slots[i]] == keyFingerprint(block[i]) && rowKey(model.columns, slots[i]) == block[i];
+            rows[blockBegin + i] = found ? static_cast<long>(slots[i]) : -1;
+        }
+    }
+}
+
+
+// word IDs of all N-grams of tokens one after another, in the layout expected by lookupBatch
+std::vector<uint32_t> collectNGramIds(const StaticModel &model, const std::vector<std::string> &tokens) {
+    const int n = model.columns.n;
+    std::vector<uint32_t> tokenIds(tokens.size());
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        tokenIds[i] = findWord(model.columns.vocabulary, tokens[i]);
+    }
+    std::vector<uint32_t> ids;
+    if (tokens.size() < static_cast<size_t>(n)) {
+        return ids;
+    }
+    ids.reserve((tokens.size() - (n - 1)) * n);
+    for (size_t i = 0; i + n <= tokens.size(); ++i) {
+        ids.insert(ids.end(), tokenIds.begin() + i, tokenIds.begin() + i + n);
+    }
+    return ids;
+}
+
+
+// rows of many N-grams at once, ids holds N word IDs of every N-gram one after another (-1 for N-grams not in model)
+void lookupBatch(const StaticModel &model, const uint32_t *ids, size_t count, long *rows) {
+    const int n = model.columns.n;
+    std::vector<uint64_t> keys(count);
+    std::vector<uint8_t> known(count);
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t *ngram = ids + i * n;
+        known[i] = std::none_of(ngram, ngram + n, [](uint32_t id) { return id == UNKNOWN_WORD; });
+        keys[i] = known[i] ? packNGramKey(ngram, n) : 0;
+    }
+    lookupKeys(model, keys.data(), count, rows);
+    for (size_t i = 0; i < count; ++i) {
+        rows[i] = known[i] ? rows[i] : -1;
+    }
+}
+
+
+// throughput of one-at-a-time lookups and of lookupBatch on all N-grams of tokens
+void benchmarkBatchLookup(const StaticModel &model, const std::vector<std::string> &tokens, int repetitions) {
+    const int n = model.columns.n;
+    if (tokens.size() < static_cast<size_t>(n)) {
+        return;
+    }
+    const size_t count = tokens.size() - (n - 1);
+    std::vector<uint32_t> ids = collectNGramIds(model, tokens);
+
+    std::vector<long> rows(count);
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; ++r) {
+        for (size_t i = 0; i < count; ++i) {
+            rows[i] = findNGram(model, ids.data() + i * n);
+        }
+    }
+    std::chrono::duration<double> single = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; ++r) {
+        lookupBatch(model, ids.data(), count, rows.data());
+    }
+    std::chrono::duration<double> batch = std::chrono::steady_clock::now() - start;
+    size_t found = std::count_if(rows.begin(), rows.end(), [](long row) { return row >= 0; });
+
+    const double numLookups = static_cast<double>(count) * repetitions;
+    std::cout << "single lookups: " << numLookups / single.count() << " per second" << std::endl;
+    std::cout << "batch lookups: " << numLookups / batch.count() << " per second (" << found << " of " << count << " N-grams found)" << std::endl;
+}
+
+
+// rows of all N-grams with given history (N-1 word IDs) in key order, only supported by EYTZINGER layout
+std::vector<long> findContinuations(const StaticModel &model, const uint32_t *historyIds) {
+    std::vector<long> rows;
+    if (model.layout != EYTZINGER || model.eytzingerKeys.size() < 2) {
+        return rows;
+    }
+    for (int i = 0; i < model.columns.n - 1; ++i) {
+        if (historyIds[i] == UNKNOWN_WORD) {
+            return rows;
+        }
+    }
+
+    // all continuations of history lie between keys (history, 0) and (history + 1, 0)
+    uint64_t history = packNGramKey(historyIds, model.columns.n - 1);
+    uint64_t first = history << WORD_ID_BITS;
+    uint64_t last = (history + 1) << WORD_ID_BITS;
+    for (size_t k = eytzingerLowerBound(model.eytzingerKeys, first); k != 0 && model.eytzingerKeys[k] < last; k = eytzingerNext(model.eytzingerKeys, k)) {
+        rows.push_back(static_cast<long>(k - 1));
+    }
+    return rows;
+}
+
+
+// rows of a PERFECT_HASH model (stored in slot order) sorted by packed key, 4 bytes per N-gram
+std::vector<uint32_t> sortRowsByKey(const ColumnarModel &columns) {
+    std::vector<std::pair<uint64_t, uint32_t>> keys(columns.probabilities.size());
+    for (size_t row = 0; row < keys.size(); ++row) {
+        keys[row] = {rowKey(columns, row), static_cast<uint32_t>(row)};
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<uint32_t> rows(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        rows[i] = keys[i].second;
+    }
+    return rows;
+}
+
+
+// rows of all N-grams with given history (N-1 word IDs), found by binary search in rows sorted by sortRowsByKey
+std::vector<long> findContinuations(const StaticModel &model, const std::vector<uint32_t> &rowsByKey, const uint32_t *historyIds) {
+    std::vector<long> rows;
+    for (int i = 0; i < model.columns.n - 1; ++i) {
+        if (historyIds[i] == UNKNOWN_WORD) {
+            return rows;
+        }
+    }
+    uint64_t history = packNGramKey(historyIds, model.columns.n - 1);
+    auto historyOf = [&model](uint32_t row) { return rowKey(model.columns, row) >> WORD_ID_BITS; };
+    auto begin = std::partition_point(rowsByKey.begin(), rowsByKey.end(), [&](uint32_t row) { return historyOf(row) < history; });
+    for (auto it = begin; it != rowsByKey.end() && historyOf(*it) == history; ++it) {
+        rows.push_back(*it);
+    }
+    return rows;
+}
+
+
+// k most probable continuations of the last N-1 words of history, straight from the sorted keys of an EYTZINGER model,
+// other layouts need their rows sorted by key (no next word index with strings is needed)
+std::vector<std::pair<std::string, double>> predictNextWords(const StaticModel &model, const std::vector<std::string> &history, size_t k,
+                                                             const std::vector<uint32_t> *rowsByKey = nullptr) {
+    std::vector<std::pair<std::string, double>> predictions;
+    const size_t historySize = model.columns.n - 1;
+    if (history.size() < historySize) {
+        return predictions;
+    }
+    uint32_t historyIds[64 / WORD_ID_BITS];
+    for (size_t i = 0; i < historySize; ++i) {
+        historyIds[i] = findWord(model.columns.vocabulary, history[history.size() - historySize + i]);
+    }
+
+    std::vector<long> rows = (rowsByKey != nullptr) ? findContinuations(model, *rowsByKey, historyIds) : findContinuations(model, historyIds);
+    auto byProbability = [&model](long a, long b) { return model.columns.probabilities[a] > model.columns.probabilities[b]; };
+    size_t numPredictions = std::min(k, rows.size());
+    std::partial_sort(rows.begin(), rows.begin() + numPredictions, rows.end(), byProbability);
+    predictions.reserve(numPredictions);
+    for (size_t i = 0; i < numPredictions; ++i) {
+        predictions.emplace_back(model.columns.vocabulary.words[model.columns.wordIds[historySize][rows[i]]], model.columns.probabilities[rows[i]]);
+    }
+    return predictions;
+}
+
+
+// probability of a looked up row, N-grams that are not in model (row -1) get 1 / number of N-grams,
+// shared by every scorer of static models so they all give the same result
+double rowProbability(const ColumnarModel &columns, long row) {
+    return (row >= 0) ? columns.probabilities[row] : 1.0 / static_cast<double>(std::max<size_t>(columns.probabilities.size(), 1));
+}
+
+
+// handle of a resolved history: last N-1 word IDs, already packed as the prefix of the next N-gram key,
+// so a word after the history is scored with one model lookup and the history moves forward without any
+struct HistoryState {
+    uint64_t packedHistory{};
+    // number of most recent words that are in vocabulary (N-grams with unknown words are never in model)
+    size_t knownWords{};
+};
+
+
+// history that ends with word (an unknown word starts over)
+HistoryState advanceHistoryState(const StaticModel &model, const HistoryState &state, uint32_t word) {
+    if (word == UNKNOWN_WORD) {
+        return {};
+    }
+    const uint64_t historyMask = (1ULL << (WORD_ID_BITS * (model.columns.n - 1))) - 1;
+    return {((state.packedHistory << WORD_ID_BITS) | word) & historyMask, state.knownWords + 1};
+}
+
+
+// history from the last N-1 words (shorter histories never complete an N-gram)
+HistoryState createHistoryState(const StaticModel &model, const std::vector<std::string> &words) {
+    HistoryState state;
+    const size_t historySize = model.columns.n - 1;
+    for (size_t i = words.size() - std::min(words.size(), historySize); i < words.size(); ++i) {
+        state = advanceHistoryState(model, state, findWord(model.columns.vocabulary, words[i]));
+    }
+    return state;
+}
+
+
+// log probability of word after history (unseen N-grams are scored with rowProbability)
+// if outState is given (it may be the same as state), it is set to the history that ends with word
+double scoreWord(const StaticModel &model, const HistoryState &state, uint32_t word, HistoryState *outState = nullptr) {
+    const size_t historySize = model.columns.n - 1;
+    long row = (word != UNKNOWN_WORD && state.knownWords >= historySize)
+            ? findKey(model, (state.packedHistory << WORD_ID_BITS) | word)
+            : -1;
+    if (outState != nullptr) {
+        *outState = advanceHistoryState(model, state, word);
+    }
+    return std::log(rowProbability(model.columns, row));
+}
+
+
+// log probabilities of many candidate next words after the same history, all resolved in one lookupKeys batch
+std::vector<double> scoreCandidates(const StaticModel &model, const HistoryState &state, const std::vector<uint32_t> &words) {
+    const size_t historySize = model.columns.n - 1;
+    std::vector<uint64_t> keys;
+    std::vector<size_t> positions;
+    for (size_t i = 0; i < words.size(); ++i) {
+        if (words[i] != UNKNOWN_WORD && state.knownWords >= historySize) {
+            keys.push_back((state.packedHistory << WORD_ID_BITS) | words[i]);
+            positions.push_back(i);
+        }
+    }
+    std::vector<long> found(keys.size());
+    lookupKeys(model, keys.data(), keys.size(), found.data());
+
+    std::vector<long> rows(words.size(), -1);
+    for (size_t i = 0; i < positions.size(); ++i) {
+        rows[positions[i]] = found[i];
+    }
+    std::vector<double> logProbabilities;
+    logProbabilities.reserve(words.size());
+    for (long row : rows) {
+        logProbabilities.push_back(std::log(rowProbability(model.columns, row)));
+    }
+    return logProbabilities;
+}
+
+
+// scores a stream of tokens one at a time, for text that is typed or received in pieces
+//
+// only the history state of the last N-1 words is kept, so an appended token costs one vocabulary lookup
+// and one model lookup
+struct StreamingScorer {
+    const StaticModel *model = nullptr;
+    HistoryState history;
+    size_t numTokens{};
+    double logSum{};
+};
+
+
+StreamingScorer createStreamingScorer(const StaticModel &model) {
+    StreamingScorer scorer;
+    scorer.model = &model;
+    return scorer;
+}
+
+
+// log probability of N-gram ending with token, 0 while first N-1 tokens are read
+// (unseen N-grams are scored with rowProbability)
+double appendToken(StreamingScorer &scorer, const std::string &token) {
+    const ColumnarModel &columns = scorer.model->columns;
+    const size_t historySize = columns.n - 1;
+    uint32_t id = findWord(columns.vocabulary, token);
+    scorer.numTokens++;
+
+    if (scorer.numTokens <= historySize) {
+        scorer.history = advanceHistoryState(*scorer.model, scorer.history, id);
+        return 0.0;
+    }
+    double logProbability = scoreWord(*scorer.model, scorer.history, id, &scorer.history);
+    scorer.logSum += logProbability;
+    return logProbability;
+}
+
+
+// perplexity of all tokens appended so far
+double streamingPerplexity(const StreamingScorer &scorer) {
+    if (scorer.numTokens < static_cast<size_t>(scorer.model->columns.n)) {
+        return 0.0;
+    }
+    return std::exp(-scorer.logSum / static_cast<double>(scorer.numTokens));
+}
+
+
+// all N-grams of test corpus are looked up with lookupBatch (same result as appending the tokens to a StreamingScorer)
+double calculatePerplexity(const StaticModel &model, const std::vector<std::string> &testTokens) {
+    const int n = model.columns.n;
+    if (testTokens.size() < static_cast<size_t>(n)) {
+        return 0.0;
+    }
+    std::vector<uint32_t> ids = collectNGramIds(model, testTokens);
+    std::vector<long> rows(testTokens.size() - (n - 1));
+    lookupBatch(model, ids.data(), rows.size(), rows.data());
+
+    double logSum = 0.0;
+    for (long row : rows) {
+        logSum += std::log(rowProbability(model.columns, row));
+    }
+    return std::exp(-logSum / static_cast<double>(testTokens.size()));
+}
+
+
+template<typename T>
+void writeBinaryVector(std::ofstream &outFile, const std::vector<T> &values) {
+    uint64_t size = values.size();
+    outFile.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    outFile.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(size * sizeof(T)));
+}
+
+
+// bytes left to read in file (0 if stream has failed)
+uint64_t remainingBytes(std::ifstream &inFile) {
+    if (!inFile) {
+        return 0;
+    }
+    std::streampos position = inFile.tellg();
+    inFile.seekg(0, std::ios::end);
+    std::streampos end = inFile.tellg();
+    inFile.seekg(position);
+    return (position < 0 || end < position) ? 0 : static_cast<uint64_t>(end - position);
+}
+
+
+// false if vector is not complete (its size is checked against rest of file before anything is allocated)
+template<typename T>
+bool readBinaryVector(std::ifstream &inFile, std::vector<T> &values) {
+    uint64_t size = 0;
+    inFile.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (!inFile || size > remainingBytes(inFile) / sizeof(T)) {
+        inFile.setstate(std::ios::failbit);
+        return false;
+    }
+    values.resize(size);
+    inFile.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(size * sizeof(T)));
+    return static_cast<bool>(inFile);
+}
+
+
+const uint32_t BINARY_MODEL_MAGIC = 0x4d324a56;    // "VJ2M"
+const uint32_t BINARY_MODEL_VERSION = 3;
+
+
+// model is written to a temporary file which then replaces the old one, so readers never see a half written model
+void saveModelToBinaryFile(const StaticModel &model, const std::string &fileName) {
+    const std::string temporaryFileName = fileName + ".tmp";
+    std::ofstream outFile(temporaryFileName, std::ios::binary);
+    if (!outFile.is_open()) {
+        std::cerr << "Unable to open the file for writing." << std::endl;
+        return;
+    }
+
+    uint32_t header[4] = {BINARY_MODEL_MAGIC, BINARY_MODEL_VERSION, static_cast<uint32_t>(model.columns.n), static_cast<uint32_t>(model.layout)};
+    outFile.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    // vocabulary as length-prefixed words
+    uint64_t vocabularySize = model.columns.vocabulary.words.size();
+    outFile.write(reinterpret_cast<const char*>(&vocabularySize), sizeof(vocabularySize));
+    for (const auto &word : model.columns.vocabulary.words) {
+        uint32_t length = word.size();
+        outFile.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        outFile.write(word.data(), length);
+    }
+
+    for (const auto &column : model.columns.wordIds) {
+        writeBinaryVector(outFile, column);
+    }
+    writeBinaryVector(outFile, model.columns.counts);
+    writeBinaryVector(outFile, model.columns.probabilities);
+
+    outFile.write(reinterpret_cast<const char*>(&model.perfectHash.numKeys), sizeof(model.perfectHash.numKeys));
+    outFile.write(reinterpret_cast<const char*>(&model.perfectHash.numBuckets), sizeof(model.perfectHash.numBuckets));
+    outFile.write(reinterpret_cast<const char*>(&model.perfectHash.seed), sizeof(model.perfectHash.seed));
+    writeBinaryVector(outFile, model.perfectHash.pilots);
+    writeBinaryVector(outFile, model.fingerprints);
+    writeBinaryVector(outFile, model.eytzingerKeys);
+    outFile.close();
+
+    std::error_code error;
+    std::filesystem::rename(temporaryFileName, fileName, error);
+    if (error) {
+        std::cerr << "Unable to replace the file." << std::endl;
+    }
+}
+
+
+// every size and index is checked, a truncated or foreign file gives an empty model instead of a broken one
+StaticModel readBinaryModel(const std::string &fileName) {
+    StaticModel model;
+    std::ifstream inFile(fileName, std::ios::binary);
+    if (!inFile.is_open()) {
+        std::cerr << "Unable to open the file." << std::endl;
+        return model;
+    }
+
+    uint32_t header[4] = {};
+    inFile.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!inFile || header[0] != BINARY_MODEL_MAGIC || header[1] != BINARY_MODEL_VERSION) {
+        std::cerr << "Not a binary model file." << std::endl;
+        return model;
+    }
+    auto corrupted = []() {
+        std::cerr << "Corrupted binary model file." << std::endl;
+        return StaticModel{};
+    };
+    if (header[2] < 1 || header[2] > static_cast<uint32_t>(64 / WORD_ID_BITS) || (header[3] != PERFECT_HASH && header[3] != EYTZINGER)) {
+        return corrupted();
+    }
+    model.columns.n = static_cast<int>(header[2]);
+    model.layout = static_cast<ModelLayout>(header[3]);
+
+    uint64_t vocabularySize = 0;
+    inFile.read(reinterpret_cast<char*>(&vocabularySize), sizeof(vocabularySize));
+    if (!inFile || vocabularySize > MAX_VOCABULARY_SIZE || vocabularySize > remainingBytes(inFile) / sizeof(uint32_t)) {
+        return corrupted();
+    }
+    model.columns.vocabulary.words.reserve(vocabularySize);
+    for (uint64_t i = 0; i < vocabularySize; ++i) {
+        uint32_t length = 0;
+        inFile.read(reinterpret_cast<char*>(&length), sizeof(length));
+        if (!inFile || length > remainingBytes(inFile)) {
+            return corrupted();
+        }
+        std::string word(length, '\0');
+        inFile.read(word.data(), length);
+        internWord(model.columns.vocabulary, word);
+    }
+    // duplicate words would shift IDs of all following words
+    if (!inFile || model.columns.vocabulary.words.size() != vocabularySize) {
+        return corrupted();
+    }
+
+    model.columns.wordIds.resize(model.columns.n);
+    for (auto &column : model.columns.wordIds) {
+        readBinaryVector(inFile, column);
+    }
+    readBinaryVector(inFile, model.columns.counts);
+    readBinaryVector(inFile, model.columns.probabilities);
+
+    inFile.read(reinterpret_cast<char*>(&model.perfectHash.numKeys), sizeof(model.perfectHash.numKeys));
+    inFile.read(reinterpret_cast<char*>(&model.perfectHash.numBuckets), sizeof(model.perfectHash.numBuckets));
+    inFile.read(reinterpret_cast<char*>(&model.perfectHash.seed), sizeof(model.perfectHash.seed));
+    readBinaryVector(inFile, model.perfectHash.pilots);
+    readBinaryVector(inFile, model.fingerprints);
+    readBinaryVector(inFile, model.eytzingerKeys);
+    if (!inFile) {
+        return corrupted();
+    }
+
+    const size_t numRows = model.columns.probabilities.size();
+    for (const auto &column : model.columns.wordIds) {
+        if (column.size() != numRows || std::any_of(column.begin(), column.end(), [&](uint32_t id) { return id >= vocabularySize; })) {
+            return corrupted();
+        }
+    }
+    if (model.columns.counts.size() != numRows) {
+        return corrupted();
+    }
+
+    // index must point every stored key to its own row
+    if (model.layout == PERFECT_HASH) {
+        const PerfectHash &perfectHash = model.perfectHash;
+        if (perfectHash.numKeys != numRows || perfectHash.numBuckets == 0 || perfectHash.pilots.size() != perfectHash.numBuckets
+                || model.fingerprints.size() != numRows || !model.eytzingerKeys.empty()) {
+            return corrupted();
+        }
+        for (size_t row = 0; row < numRows; ++row) {
+            uint64_t key = rowKey(model.columns, row);
+            if (perfectHashSlot(perfectHash, key) != row || model.fingerprints[row] != keyFingerprint(key)) {
+                return corrupted();
+            }
+        }
+    }
+    else {
+        if (model.eytzingerKeys.size() != numRows + 1 || !model.perfectHash.pilots.empty() || !model.fingerprints.empty()) {
+            return corrupted();
+        }
+        for (size_t k = 1; k <= numRows; ++k) {
+            if (model.eytzingerKeys[k] != rowKey(model.columns, k - 1)) {
+                return corrupted();
+            }
+        }
+    }
+    return model;
+}
+
+
+enum InterpolationType {
+    LINEAR,
+    LOG_LINEAR
+};
+
+
+// several loaded models of the same order combined into a single scorer
+struct MixtureModel {
+    int n{};
+    std::vector<std::unordered_map<std::string, double>> probabilities;
+    // probability used for N-grams not found in a component (same fallback as in calculatePerplexity)
+    std::vector<double> unseenProbabilities;
+    std::vector<double> weights;
+};
+
+
+// components without any N-grams (e.g. missing model files) are rejected, as their unseen probability would be 1
+// and tuning would move all weight to them (empty mixture is returned)
+MixtureModel createMixtureModel(const std::vector<std::vector<NGram>> &models, int n) {
+    MixtureModel mixture;
+    mixture.n = n;
+    for (const auto &model : models) {
+        std::unordered_map<std::string, double> index;
+        index.reserve(model.size());
+        for (const auto &ngram : model) {
+            // skip malformed lines of model files (N-grams made of empty tokens)
+            if (ngram.words.size() == static_cast<size_t>(n)) {
+                index.emplace(joinNGramKey(ngram.words, 0, n), ngram.probability);
+            }
+        }
+        if (index.empty()) {
+            std::cerr << "Mixture component has no N-grams." << std::endl;
+            return {};
+        }
+        mixture.probabilities.push_back(std::move(index));
+        mixture.unseenProbabilities.push_back(1.0 / static_cast<double>(model.size()));
+    }
+    // start with uniform weights
+    mixture.weights.assign(models.size(), 1.0 / static_cast<double>(models.size()));
+    return mixture;
+}
+
+
+// looks up every test N-gram once in every component
+// result is a row-major matrix (one row per N-gram, one column per component)
+std::vector<double> lookupComponentProbabilities(const MixtureModel &mixture, const std::vector<std::string> &tokens) {
+    const size_t numComponents = mixture.probabilities.size();
+    if (tokens.size() < static_cast<size_t>(mixture.n)) {
+        return {};
+    }
+    const size_t numNGrams = tokens.size() - (mixture.n - 1);
+    std::vector<double> matrix(numNGrams * numComponents);
+
+    parallelFor(numNGrams, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            std::string key = joinNGramKey(tokens, i, mixture.n);
+            double *row = &matrix[i * numComponents];
+            for (size_t m = 0; m < numComponents; ++m) {
+                auto it = mixture.probabilities[m].find(key);
+                row[m] = (it != mixture.probabilities[m].end()) ? it->second : mixture.unseenProbabilities[m];
+            }
+        }
+    });
+    return matrix;
+}
+
+
+// linear: sum of weighted probabilities
+// log-linear: weighted geometric mean (not renormalised over vocabulary, so only useful for ranking)
+double interpolateProbability(const MixtureModel &mixture, const double *componentProbabilities, InterpolationType type) {
+    const size_t numComponents = mixture.weights.size();
+    if (type == LINEAR) {
+        double probability = 0.0;
+        for (size_t m = 0; m < numComponents; ++m) {
+            probability += mixture.weights[m] * componentProbabilities[m];
+        }
+        return probability;
+    }
+    double logProbability = 0.0;
+    for (size_t m = 0; m < numComponents; ++m) {
+        logProbability += mixture.weights[m] * std::log(componentProbabilities[m]);
+    }
+    return std::exp(logProbability);
+}
+
+
+double calculateMixturePerplexity(const MixtureModel &mixture, const std::vector<std::string> &testTokens, InterpolationType type) {
+    std::vector<double> matrix = lookupComponentProbabilities(mixture, testTokens);
+    const size_t numComponents = mixture.weights.size();
+    if (matrix.empty() || numComponents == 0) {
+        return 0.0;
+    }
+
+    // sum logarithms instead of multiplying probabilities to avoid underflow
+    double logSum = 0.0;
+    for (size_t i = 0; i < matrix.size() / numComponents; ++i) {
+        logSum += std::log(interpolateProbability(mixture, &matrix[i * numComponents], type));
+    }
+    return std::exp(-logSum / static_cast<double>(testTokens.size()));
+}
+
+
+// tunes linear interpolation weights on held-out tokens with expectation maximization
+void tuneMixtureWeights(MixtureModel &mixture, const std::vector<std::string> &heldOutTokens, int iterations) {
+    std::vector<double> matrix = lookupComponentProbabilities(mixture, heldOutTokens);
+    const size_t numComponents = mixture.weights.size();
+    if (matrix.empty() || numComponents == 0) {
+        return;
+    }
+    const size_t numNGrams = matrix.size() / numComponents;
+
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        // E-step: every thread accumulates posterior component responsibilities for its own chunk
+        std::mutex mutex;
+        std::vector<double> expectedCounts(numComponents, 0.0);
+        parallelFor(numNGrams, [&](size_t begin, size_t end) {
+            std::vector<double> localCounts(numComponents, 0.0);
+            for (size_t i = begin; i < end; ++i) {
+                const double *row = &matrix[i * numComponents];
+                double total = interpolateProbability(mixture, row, LINEAR);
+                for (size_t m = 0; m < numComponents; ++m) {
+                    localCounts[m] += mixture.weights[m] * row[m] / total;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t m = 0; m < numComponents; ++m) {
+                expectedCounts[m] += localCounts[m];
+            }
+        });
+
+        // M-step: new weights are normalized expected counts
+        for (size_t m = 0; m < numComponents; ++m) {
+            mixture.weights[m] = expectedCounts[m] / static_cast<double>(numNGrams);
+        }
+    }
+}
+
+
+struct PruningOptions {
+    // minimum count an N-gram needs to be kept, indexed by N-gram size
+    std::vector<int> minCounts{1, 1, 1, 1};
+    // relative entropy threshold for Stolcke pruning (0 disables it)
+    double entropyThreshold = 0.0;
+};
+
+
+// count cutoff followed by Stolcke relative entropy pruning
+//
+// removed N-gram (h, w) falls back to lower order estimate q(w) scaled by backoff weight alpha(h),
+// which is renormalized after removal --> alpha'(h) = (1 - sum p(v|h) + p(w|h)) / (1 - sum q(v) + q(w))
+// N-gram is dropped if weighted change of relative entropy D(h, w) is below the threshold
+std::vector<NGram> pruneNGrams(const std::vector<NGram> &model, int n, const PruningOptions &options) {
+    const int minCount = (n < static_cast<int>(options.minCounts.size())) ? options.minCounts[n] : 1;
+    std::vector<NGram> kept;
+    kept.reserve(model.size());
+    for (const auto &ngram : model) {
+        if (ngram.count >= minCount && ngram.words.size() == static_cast<size_t>(n)) {
+            kept.push_back(ngram);
+        }
+    }
+    if (options.entropyThreshold <= 0.0 || kept.empty()) {
+        return kept;
+    }
+
+    // lower order distribution q(w) estimated from counts of last words
+    double totalCount = 0.0;
+    std::unordered_map<std::string, double> lowerOrder;
+    for (const auto &ngram : kept) {
+        lowerOrder[ngram.words[n-1]] += ngram.count;
+        totalCount += ngram.count;
+    }
+    for (auto &entry : lowerOrder) {
+        entry.second /= totalCount;
+    }
+
+    // per history: count, sum of probabilities of seen words and sum of their lower order probabilities
+    struct HistoryMass {
+        double count = 0.0;
+        double probabilitySum = 0.0;
+        double lowerOrderSum = 0.0;
+    };
+    std::unordered_map<std::string, HistoryMass> histories;
+    for (const auto &ngram : kept) {
+        HistoryMass &mass = histories[joinNGramKey(ngram.words, 0, n - 1)];
+        mass.count += ngram.count;
+        mass.probabilitySum += ngram.probability;
+        mass.lowerOrderSum += lowerOrder[ngram.words[n-1]];
+    }
+
+    // smoothed models may already overshoot probability mass of a history, so keep backoff mass positive
+    const double epsilon = 1e-12;
+    std::vector<NGram> pruned;
+    pruned.reserve(kept.size());
+    for (const auto &ngram : kept) {
+        const HistoryMass &mass = histories[joinNGramKey(ngram.words, 0, n - 1)];
+        double historyProbability = mass.count / totalCount;
+        double p = ngram.probability;
+        double q = lowerOrder[ngram.words[n-1]];
+
+        double backoffMass = std::max(1.0 - mass.probabilitySum, epsilon);
+        double alpha = backoffMass / std::max(1.0 - mass.lowerOrderSum, epsilon);
+        double prunedAlpha = (backoffMass + p) / std::max(1.0 - mass.lowerOrderSum + q, epsilon);
+
+        double entropyChange = -historyProbability * (p * (std::log(prunedAlpha * q) - std::log(p))
+                + backoffMass * (std::log(prunedAlpha) - std::log(alpha)));
+
+        if (entropyChange >= options.entropyThreshold) {
+            pruned.push_back(ngram);
+        }
+    }
+    return pruned;
+}
+
+
+// number of bytes the model takes when written with saveModelToFile
+size_t estimateModelFileSize(const std::vector<NGram> &model) {
+    size_t bytes = 0;
+    std::ostringstream line;
+    for (const auto &ngram : model) {
+        line.str("");
+        for (const auto &word : ngram.words) {
+            line << word << " ";
+        }
+        line << ngram.count << " " << ngram.probability << "\n";
+        bytes += line.tellp();
+    }
+    return bytes;
+}
+
+
+void reportPruning(const std::vector<NGram> &original, const std::vector<NGram> &pruned, const std::vector<std::string> &testTokens, int n) {
+    // single component mixture is plain hashed lookup of the model
+    double originalPerplexity = calculateMixturePerplexity(createMixtureModel({original}, n), testTokens, LINEAR);
+    double prunedPerplexity = calculateMixturePerplexity(createMixtureModel({pruned}, n), testTokens, LINEAR);
+
+    std::cout << std::endl << "pruning results:" << std::endl;
+    std::cout << "N-grams: " << original.size() << " --> " << pruned.size() << std::endl;
+    std::cout << "file size (bytes): " << estimateModelFileSize(original) << " --> " << estimateModelFileSize(pruned) << std::endl;
+    std::cout << "perplexity on test corpus: " << originalPerplexity << " --> " << prunedPerplexity << std::endl;
+}
+
+
+// candidate next words of every history, stored contiguously by descending probability
+struct NextWordIndex {
+    int n{};
+    std::vector<std::string> words;
+    std::vector<double> probabilities;
+    // history key --> range [begin, end) of its candidates
+    std::unordered_map<std::string, std::pair<size_t, size_t>> histories;
+};
+
+
+NextWordIndex buildNextWordIndex(const std::vector<NGram> &model, int n) {
+    NextWordIndex index;
+    index.n = n;
+
+    std::vector<const NGram*> sorted;
+    sorted.reserve(model.size());
+    for (const auto &ngram : model) {
+        if (ngram.words.size() == static_cast<size_t>(n)) {
+            sorted.push_back(&ngram);
+        }
+    }
+    // models saved with saveModelToFile are already in history order
+    auto compare = [](const NGram *a, const NGram *b) { return historyOrder(*a, *b); };
+    if (!std::is_sorted(sorted.begin(), sorted.end(), compare)) {
+        std::stable_sort(sorted.begin(), sorted.end(), compare);
+    }
+
+    index.words.reserve(sorted.size());
+    index.probabilities.reserve(sorted.size());
+    std::string previousHistory;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        std::string history = joinNGramKey(sorted[i]->words, 0, n - 1);
+        if (i == 0 || history != previousHistory) {
+            index.histories[history] = {i, i};
+            previousHistory = history;
+        }
+        index.histories[history].second = i + 1;
+        index.words.push_back(sorted[i]->words[n-1]);
+        index.probabilities.push_back(sorted[i]->probability);
+    }
+    return index;
+}
+
+
+// k most probable continuations of the last N-1 words of history
+std::vector<std::pair<std::string, double>> predictNextWords(const NextWordIndex &index, const std::vector<std::string> &history, size_t k) {
+    std::vector<std::pair<std::string, double>> predictions;
+    if (history.size() < static_cast<size_t>(index.n - 1)) {
+        return predictions;
+    }
+
+    auto it = index.histories.find(joinNGramKey(history, history.size() - (index.n - 1), index.n - 1));
+    if (it == index.histories.end()) {
+        return predictions;
+    }
+
+    size_t end = std::min(it->second.second, it->second.first + k);
+    predictions.reserve(end - it->second.first);
+    for (size_t i = it->second.first; i < end; ++i) {
+        predictions.emplace_back(index.words[i], index.probabilities[i]);
+    }
+    return predictions;
+}
+
+
+// samples sentences from a model with O(1) draws from alias tables (one table per history)
+struct TextGenerator {
+    NextWordIndex index;
+    // alias table entries are aligned with candidate arrays of the index,
+    // aliases are offsets inside the range of the same history
+    std::vector<double> aliasProbabilities;
+    std::vector<uint32_t> aliases;
+};
+
+
+// Vose's alias method for every candidate range of the index
+TextGenerator createTextGenerator(NextWordIndex index) {
+    TextGenerator generator;
+    generator.aliasProbabilities.assign(index.words.size(), 1.0);
+    generator.aliases.assign(index.words.size(), 0);
+
+    std::vector<uint32_t> small;
+    std::vector<uint32_t> large;
+    std::vector<double> scaled;
+    for (const auto &[history, range] : index.histories) {
+        const size_t begin = range.first;
+        const uint32_t size = range.second - range.first;
+        double total = 0.0;
+        for (size_t i = begin; i < range.second; ++i) {
+            total += index.probabilities[i];
+        }
+
+        small.clear();
+        large.clear();
+        scaled.resize(size);
+        for (uint32_t i = 0; i < size; ++i) {
+            scaled[i] = index.probabilities[begin + i] * size / total;
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t less = small.back();
+            small.pop_back();
+            uint32_t more = large.back();
+            generator.aliasProbabilities[begin + less] = scaled[less];
+            generator.aliases[begin + less] = more;
+            scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+            if (scaled[more] < 1.0) {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+        // leftovers (numerical errors) always pick themselves
+        for (uint32_t i : small) {
+            generator.aliasProbabilities[begin + i] = 1.0;
+        }
+        for (uint32_t i : large) {
+            generator.aliasProbabilities[begin + i] = 1.0;
+        }
+    }
+
+    generator.index = std::move(index);
+    return generator;
+}
+
+
+// history a generated sentence starts with (sentences in corpus follow each other, so trigrams start after </s> <s>)
+std::vector<std::string> sentenceStartHistory(int n) {
+    std::vector<std::string> history;
+    if (n > 2) {
+        history.assign(n - 2, "</s>");
+    }
+    history.emplace_back("<s>");
+    return history;
+}
+
+
+// index of sampled candidate or -1 if history was never seen
+long sampleNextWord(const TextGenerator &generator, const std::vector<std::string> &history, std::mt19937_64 &rng) {
+    const int n = generator.index.n;
+    auto it = generator.index.histories.find(joinNGramKey(history, history.size() - (n - 1), n - 1));
+    if (it == generator.index.histories.end()) {
+        return -1;
+    }
+
+    const size_t begin = it->second.first;
+    const size_t size = it->second.second - begin;
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    double draw = uniform(rng) * static_cast<double>(size);
+    size_t column = std::min(static_cast<size_t>(draw), size - 1);
+    if (draw - static_cast<double>(column) < generator.aliasProbabilities[begin + column]) {
+        return static_cast<long>(begin + column);
+    }
+    return static_cast<long>(begin + generator.aliases[begin + column]);
+}
+
+
+std::vector<std::string> generateSentence(const TextGenerator &generator, std::mt19937_64 &rng, size_t maxLength) {
+    std::vector<std::string> history = sentenceStartHistory(generator.index.n);
+    std::vector<std::string> sentence;
+    while (sentence.size() < maxLength) {
+        long candidate = sampleNextWord(generator, history, rng);
+        if (candidate < 0 || generator.index.words[candidate] == "</s>") {
+            break;
+        }
+        sentence.push_back(generator.index.words[candidate]);
+        history.push_back(generator.index.words[candidate]);
+    }
+    return sentence;
+}
+
+
+// most probable sentence found by beam search (hypotheses are compared by average log probability per word)
+std::vector<std::string> beamSearchSentence(const TextGenerator &generator, size_t beamWidth, size_t maxLength) {
+    struct Hypothesis {
+        std::vector<std::string> words;
+        double logProbability = 0.0;
+    };
+    const NextWordIndex &index = generator.index;
+    const size_t prefixLength = index.n - 1;
+    auto score = [prefixLength](const Hypothesis &hypothesis) {
+        return hypothesis.logProbability / static_cast<double>(hypothesis.words.size() - prefixLength);
+    };
+
+    std::vector<Hypothesis> beam{{sentenceStartHistory(index.n), 0.0}};
+    Hypothesis best;
+    bool finished = false;
+
+    for (size_t step = 0; step < maxLength && !beam.empty(); ++step) {
+        std::vector<Hypothesis> expanded;
+        for (const auto &hypothesis : beam) {
+            // candidates are sorted by probability, so only the first beamWidth are worth expanding
+            for (const auto &[word, probability] : predictNextWords(index, hypothesis.words, beamWidth)) {
+                Hypothesis next{hypothesis.words, hypothesis.logProbability + std::log(probability)};
+                next.words.push_back(word);
+                if (word == "</s>") {
+                    // empty sentences are not useful results
+                    if (hypothesis.words.size() == prefixLength) {
+                        continue;
+                    }
+                    if (!finished || score(next) > score(best)) {
+                        best = std::move(next);
+                        finished = true;
+                    }
+                }
+                else {
+                    expanded.push_back(std::move(next));
+                }
+            }
+        }
+        size_t keep = std::min(beamWidth, expanded.size());
+        std::partial_sort(expanded.begin(), expanded.begin() + keep, expanded.end(),
+                          [](const Hypothesis &a, const Hypothesis &b) { return a.logProbability > b.logProbability; });
+        expanded.resize(keep);
+        beam = std::move(expanded);
+    }
+
+    if (!finished) {
+        if (beam.empty()) {
+            return {};
+        }
+        best = beam.front();
+    }
+    std::vector<std::string> sentence(best.words.begin() + prefixLength, best.words.end());
+    if (!sentence.empty() && sentence.back() == "</s>") {
+        sentence.pop_back();
+    }
+    return sentence;
+}
+
+
+// generates sentences until given number of lookups is reached and reports lookup throughput
+void benchmarkSampling(const TextGenerator &generator, size_t numLookups) {
+    std::mt19937_64 rng(42);
+    std::vector<std::string> history = sentenceStartHistory(generator.index.n);
+    size_t sentences = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < numLookups; ++i) {
+        long candidate = sampleNextWord(generator, history, rng);
+        if (candidate < 0 || generator.index.words[candidate] == "</s>") {
+            history = sentenceStartHistory(generator.index.n);
+            sentences++;
+            continue;
+        }
+        history.erase(history.begin());
+        history.push_back(generator.index.words[candidate]);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << numLookups << " lookups (" << sentences << " sentences) in " << elapsed.count() << " s --> "
+              << static_cast<double>(numLookups) / elapsed.count() << " lookups per second" << std::endl;
+}
+
+
+// kas-5000-kneser-ney-bigrams.txt --> kas-5000-kneser-ney-bigrams.bin
+std::string binaryModelName(const std::string &modelFileName) {
+    return modelFileName.substr(0, modelFileName.rfind('.')) + ".bin";
+}
+
+
+// direct-mapped cache of recent lookups (packed key --> row, -1 for keys not in model)
+//
+// every key has exactly one slot, so a lookup is one hash and one 16-byte load without any locking,
+// the cache is used by one thread only (the scoring event loop)
+// top bit of a stored key is the CLOCK reference bit: a slot that was hit since it was filled survives one
+// conflicting insert (which clears the bit) before it is replaced
+struct LookupCache {
+    struct Entry {
+        // packed key + 1 (0 marks an empty slot, packed keys use at most 63 bits)
+        uint64_t key;
+        long row;
+    };
+
+    std::vector<Entry> entries;
+    size_t mask{};
+    uint64_t hits{};
+    uint64_t misses{};
+};
+
+
+const uint64_t CACHE_REFERENCED = 1ULL << 63;
+
+
+// capacity is rounded up to a power of two
+LookupCache createLookupCache(size_t capacity) {
+    LookupCache cache;
+    size_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    cache.entries.assign(size, {0, -1});
+    cache.mask = size - 1;
+    return cache;
+}
+
+
+bool findInCache(LookupCache &cache, uint64_t key, long &row) {
+    LookupCache::Entry &entry = cache.entries[mixHash(key, 5) & cache.mask];
+    if ((entry.key & ~CACHE_REFERENCED) == key + 1) {
+        entry.key |= CACHE_REFERENCED;
+        row = entry.row;
+        cache.hits++;
+        return true;
+    }
+    cache.misses++;
+    return false;
+}
+
+
+void addToCache(LookupCache &cache, uint64_t key, long row) {
+    LookupCache::Entry &entry = cache.entries[mixHash(key, 5) & cache.mask];
+    if (entry.key & CACHE_REFERENCED) {
+        entry.key &= ~CACHE_REFERENCED;
+        return;
+    }
+    entry = {key + 1, row};
+}
+
+
+double cacheHitRate(const LookupCache &cache) {
+    double lookups = static_cast<double>(cache.hits + cache.misses);
+    return (lookups > 0) ? static_cast<double>(cache.hits) / lookups : 0.0;
+}
+
+
+// cache of scoring server (16 MB per model at most), batches of 20-token requests resolved 10-20 % faster on models
+// of 30 thousand N-grams and about 25 % faster on a model of 6.7 million N-grams (70 % hit rate)
+const size_t SERVED_MODEL_CACHE_CAPACITY = 1 << 20;
+
+
+// binary model kept in memory by the scoring server, together with its next word candidates
+struct ServedModel {
+    StaticModel model;
+    // rows sorted by key, only needed by PERFECT_HASH layout, EYTZINGER layout finds continuations in its sorted keys
+    std::vector<uint32_t> rowsByKey;
+    // cache of recent lookups (none if capacity is 0), only touched by the event loop thread,
+    // a reloaded model starts with an empty cache
+    std::unique_ptr<LookupCache> cache;
+};
+
+
+ServedModel loadServedModel(const std::string &fileName, size_t cacheCapacity = 0) {
+    ServedModel served;
+    served.model = readBinaryModel(fileName);
+    if (served.model.columns.n != 0 && served.model.layout == PERFECT_HASH) {
+        served.rowsByKey = sortRowsByKey(served.model.columns);
+    }
+    // cache is never larger than the model itself
+    cacheCapacity = std::min(cacheCapacity, served.model.columns.probabilities.size());
+    if (cacheCapacity > 0) {
+        served.cache = std::make_unique<LookupCache>(createLookupCache(cacheCapacity));
+    }
+    return served;
+}
+
+
+// served model that can be replaced while the server is running
+//
+// every query holds a reference to the model it started on, so a query in flight during a swap finishes on the old model
+// and the old model is released only after its last query
+struct ModelSlot {
+    std::string fileName;
+    // capacity of lookup cache of every loaded version (0 for no cache)
+    size_t cacheCapacity{};
+    std::atomic<std::shared_ptr<const ServedModel>> current;
+    // file time of the loaded model
+    std::filesystem::file_time_type loadedTime;
+};
+
+
+bool addModelSlot(std::unordered_map<std::string, ModelSlot> &models, const std::string &modelName, const std::string &fileName,
+                  size_t cacheCapacity = 0) {
+    std::error_code error;
+    auto loadedTime = std::filesystem::last_write_time(fileName, error);
+    auto served = std::make_shared<const ServedModel>(loadServedModel(fileName, cacheCapacity));
+    if (error || served->model.columns.probabilities.empty()) {
+        return false;
+    }
+    ModelSlot &slot = models[modelName];
+    slot.fileName = fileName;
+    slot.cacheCapacity = cacheCapacity;
+    slot.loadedTime = loadedTime;
+    slot.current.store(std::move(served));
+    return true;
+}
+
+
+// reloads served models in the background when their files are replaced
+struct ModelWatcher {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopped = false;
+};
+
+
+// model is loaded and validated on the watcher thread and then swapped in with a single atomic store,
+// replaced models are released on the watcher thread as well, once no query uses them anymore
+void startModelWatcher(ModelWatcher &watcher, std::unordered_map<std::string, ModelSlot> &models, std::chrono::milliseconds interval) {
+    watcher.thread = std::thread([&watcher, &models, interval]() {
+        std::vector<std::shared_ptr<const ServedModel>> retired;
+        std::unique_lock<std::mutex> lock(watcher.mutex);
+        while (!watcher.wakeUp.wait_for(lock, interval, [&watcher] { return watcher.stopped; })) {
+            retired.erase(std::remove_if(retired.begin(), retired.end(), [](const auto &model) { return model.use_count() == 1; }), retired.end());
+
+            for (auto &[modelName, slot] : models) {
+                std::error_code error;
+                auto fileTime = std::filesystem::last_write_time(slot.fileName, error);
+                if (error || fileTime == slot.loadedTime) {
+                    continue;
+                }
+                slot.loadedTime = fileTime;
+
+                auto served = std::make_shared<const ServedModel>(loadServedModel(slot.fileName, slot.cacheCapacity));
+                std::shared_ptr<const ServedModel> current = slot.current.load();
+                if (served->model.columns.probabilities.empty() || served->model.columns.n != current->model.columns.n) {
+                    std::cerr << "Rejected new version of model " << modelName << "." << std::endl;
+                    continue;
+                }
+                slot.current.store(std::move(served));
+                retired.push_back(std::move(current));
+                std::cout << "reloaded " << modelName << std::endl;
+            }
+        }
+    });
+}
+
+
+void stopModelWatcher(ModelWatcher &watcher) {
+    {
+        std::lock_guard<std::mutex> lock(watcher.mutex);
+        watcher.stopped = true;
+    }
+    watcher.wakeUp.notify_all();
+    watcher.thread.join();
+}
+
+
+// request line of the scoring protocol:
+//   score <model> <text>        --> ok <natural logarithm of probability of all N-grams of text>
+//   perplexity <model> <text>   --> ok <perplexity of text>
+//   next <model> <k> <history>  --> ok <word> <probability> ... (k most probable next words)
+//   stats <model>               --> ok <cache hits> <cache misses> <cache hit rate>
+// text is preprocessed like the test corpus, history words are only normalized (<s> can start a history)
+//
+// score and perplexity requests are split into lookups of packed keys, so lookups of many requests can be resolved together
+struct ScoringQuery {
+    // keeps the model alive until the query is finished, even if it is swapped in the meantime
+    std::shared_ptr<const ServedModel> served;
+    bool perplexity = false;
+    size_t numTokens{};
+    // NO_KEY for N-grams with words outside of vocabulary
+    std::vector<uint64_t> keys;
+    std::vector<long> rows;
+    // final response of requests that need no lookups
+    std::string response;
+};
+
+
+const uint64_t NO_KEY = UINT64_MAX;
+
+
+ScoringQuery prepareScoringQuery(const std::unordered_map<std::string, ModelSlot> &models, const std::string &request) {
+    ScoringQuery query;
+    std::istringstream iss(request);
+    std::string command;
+    std::string modelName;
+    iss >> command >> modelName;
+
+    if (command != "score" && command != "perplexity" && command != "next" && command != "stats") {
+        query.response = "error unknown command " + command;
+        return query;
+    }
+    auto it = models.find(modelName);
+    if (it == models.end()) {
+        query.response = "error unknown model " + modelName;
+        return query;
+    }
+    std::shared_ptr<const ServedModel> current = it->second.current.load();
+    const ServedModel &served = *current;
+    const int n = served.model.columns.n;
+
+    if (command == "score" || command == "perplexity") {
+        std::string text;
+        std::getline(iss, text);
+        std::vector<std::string> tokens;
+        appendSentenceTokens(text, tokens);
+
+        query.served = current;
+        query.perplexity = command == "perplexity";
+        query.numTokens = tokens.size();
+        std::vector<uint32_t> ids(tokens.size());
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            ids[i] = findWord(served.model.columns.vocabulary, tokens[i]);
+        }
+        for (size_t i = 0; i + n <= ids.size(); ++i) {
+            bool known = std::none_of(ids.begin() + i, ids.begin() + i + n, [](uint32_t id) { return id == UNKNOWN_WORD; });
+            query.keys.push_back(known ? packNGramKey(&ids[i], n) : NO_KEY);
+        }
+        query.rows.assign(query.keys.size(), -1);
+        return query;
+    }
+    if (command == "next") {
+        size_t k = 0;
+        if (!(iss >> k)) {
+            query.response = "error missing number of words";
+            return query;
+        }
+        std::vector<std::string> history;
+        std::string word;
+        while (iss >> word) {
+            // sentence boundary markers are kept as they are
+            if (word != "<s>" && word != "</s>") {
+                normalizeToken(word);
+            }
+            history.push_back(word);
+        }
+        query.response = "ok";
+        auto predictions = predictNextWords(served.model, history, k, (served.model.layout == EYTZINGER) ? nullptr : &served.rowsByKey);
+        for (const auto &[candidate, probability] : predictions) {
+            query.response += " " + candidate + " " + std::to_string(probability);
+        }
+        return query;
+    }
+    // stats
+    query.response = served.cache
+            ? "ok " + std::to_string(served.cache->hits) + " " + std::to_string(served.cache->misses) + " " + std::to_string(cacheHitRate(*served.cache))
+            : "ok 0 0 0";
+    return query;
+}
+
+
+// response from resolved rows (unseen N-grams are scored with rowProbability)
+std::string finishScoringQuery(const ScoringQuery &query) {
+    if (!query.served) {
+        return query.response;
+    }
+    const ColumnarModel &columns = query.served->model.columns;
+    double logProbability = 0.0;
+    for (long row : query.rows) {
+        logProbability += std::log(rowProbability(columns, row));
+    }
+    if (query.perplexity) {
+        double perplexity = (query.numTokens < static_cast<size_t>(columns.n)) ? 0.0 : std::exp(-logProbability / static_cast<double>(query.numTokens));
+        return "ok " + std::to_string(perplexity);
+    }
+    return "ok " + std::to_string(logProbability);
+}
+
+
+// lookups of many queries resolved at once: sorted by model and key, so equal keys are looked up only once,
+// cached keys skip the index (if model has a cache), and the rest is resolved with lookupKeys
+void resolveScoringQueries(const std::vector<ScoringQuery*> &queries) {
+    struct Lookup {
+        const ServedModel *served;
+        uint64_t key;
+        long *row;
+    };
+    std::vector<Lookup> lookups;
+    for (ScoringQuery *query : queries) {
+        for (size_t i = 0; i < query->keys.size(); ++i) {
+            if (query->keys[i] != NO_KEY) {
+                lookups.push_back({query->served.get(), query->keys[i], &query->rows[i]});
+            }
         }
-        outFile << ngram.count << " " << ngram.probability << "\n";
     }
+    std::sort(lookups.begin(), lookups.end(), [](const Lookup &a, const Lookup &b) {
+        return (a.served != b.served) ? std::less<>()(a.served, b.served) : a.key < b.key;
+    });
+    auto repeated = [&lookups](size_t i) {
+        return i > 0 && lookups[i].served == lookups[i - 1].served && lookups[i].key == lookups[i - 1].key;
+    };
 
-    outFile.close();
+    std::vector<const Lookup*> pending;
+    for (size_t i = 0; i < lookups.size(); ++i) {
+        LookupCache *cache = lookups[i].served->cache.get();
+        if (!repeated(i) && (cache == nullptr || !findInCache(*cache, lookups[i].key, *lookups[i].row))) {
+            pending.push_back(&lookups[i]);
+        }
+    }
+
+    // remaining keys of every model go through the batch kernel
+    std::vector<uint64_t> keys;
+    std::vector<long> rows;
+    for (size_t begin = 0, end = 0; begin < pending.size(); begin = end) {
+        const ServedModel &served = *pending[begin]->served;
+        keys.clear();
+        for (end = begin; end < pending.size() && pending[end]->served == &served; ++end) {
+            keys.push_back(pending[end]->key);
+        }
+        rows.resize(keys.size());
+        lookupKeys(served.model, keys.data(), keys.size(), rows.data());
+        for (size_t i = begin; i < end; ++i) {
+            *pending[i]->row = rows[i - begin];
+            if (served.cache) {
+                addToCache(*served.cache, pending[i]->key, rows[i - begin]);
+            }
+        }
+    }
+
+    for (size_t i = 1; i < lookups.size(); ++i) {
+        if (repeated(i)) {
+            *lookups[i].row = *lookups[i - 1].row;
+        }
+    }
 }
 
 
-std::vector<NGram> readModel(const std::string &fileName, int n) {
-    // open file
-    std::vector<NGram> ngrams;
-    std::ifstream inFile(fileName);
-    if (!inFile.is_open()) {
-        std::cerr << "Unable to open the file for writing." << std::endl;
-        return ngrams;
+// every frame is a 4-byte little endian payload length followed by the payload,
+// payload of a request frame is a batch of request lines, response frame has one line per request in the same order
+const uint32_t MAX_FRAME_SIZE = 1u << 24;
+
+
+void appendFrame(std::string &buffer, const std::string &payload) {
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    for (int i = 0; i < 4; ++i) {
+        buffer.push_back(static_cast<char>((length >> (8 * i)) & 0xff));
+    }
+    buffer += payload;
+}
+
+
+// length of frame at the front of buffer (buffer must hold at least 4 bytes)
+uint32_t frameLength(const std::string &buffer) {
+    uint32_t length = 0;
+    for (int i = 0; i < 4; ++i) {
+        length |= static_cast<uint32_t>(static_cast<unsigned char>(buffer[i])) << (8 * i);
+    }
+    return length;
+}
+
+
+// removes first complete frame from buffer, returns false if there is none yet
+bool takeFrame(std::string &buffer, std::string &payload) {
+    if (buffer.size() < 4 || buffer.size() < 4 + static_cast<size_t>(frameLength(buffer))) {
+        return false;
     }
+    uint32_t length = frameLength(buffer);
+    payload = buffer.substr(4, length);
+    buffer.erase(0, 4 + static_cast<size_t>(length));
+    return true;
+}
 
+
+std::vector<std::string> splitLines(const std::string &payload) {
+    std::vector<std::string> lines;
+    std::istringstream iss(payload);
     std::string line;
-    while(std::getline(inFile, line)) {
-        std::istringstream iss(line);
-        std::string token;
-        NGram ngram;
+    while (std::getline(iss, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
 
-        int words = 0;
-        // read words
-        while (iss >> token && words < n) {
-            ngram.words.push_back(token);
-            words++;
+
+std::string joinLines(const std::vector<std::string> &lines) {
+    std::string payload;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        payload += (i == 0) ? lines[i] : "\n" + lines[i];
+    }
+    return payload;
+}
+
+
+#ifdef SCORING_SERVER_SUPPORTED
+
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+
+sockaddr_un unixSocketAddress(const std::string &socketPath) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+
+// coroutine serving one connection, it starts right away and is destroyed by the event loop once it is done
+struct ConnectionTask {
+    struct promise_type {
+        ConnectionTask get_return_object() {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
         }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
 
-        // read count
-        ngram.count = std::stoi(token);
+    std::coroutine_handle<promise_type> handle;
+};
 
 
-        // read probability
-        iss >> token;
-        ngram.probability = std::stod(token);
+// single-threaded event loop of the scoring server
+struct ScoringEventLoop {
+    const std::unordered_map<std::string, ModelSlot> *models = nullptr;
+    bool running = true;
+    // coroutines suspended until their socket is readable or writable
+    std::vector<pollfd> waitingSockets;
+    std::vector<std::coroutine_handle<>> waitingHandles;
+    // queries of the current micro batch and coroutines waiting for them
+    std::vector<ScoringQuery*> batch;
+    std::vector<std::coroutine_handle<>> batchWaiters;
+};
 
-        ngrams.push_back(ngram);
+
+// co_await suspends until socket has given events
+struct SocketReady {
+    ScoringEventLoop &loop;
+    int socket;
+    short events;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        loop.waitingSockets.push_back({socket, events, 0});
+        loop.waitingHandles.push_back(handle);
     }
+    void await_resume() const noexcept {}
+};
 
-    return ngrams;
-}
 
+// co_await suspends until lookups of queries are resolved together with lookups of other connections
+struct QueriesResolved {
+    ScoringEventLoop &loop;
+    std::vector<ScoringQuery> &queries;
 
-std::vector<NGram> createTestNgrams(std::vector<NGram>& model, std::vector<std::string>& testTokens, int n) {
-    std::vector<NGram> testNgrams;
-    for (size_t i = 0; i < testTokens.size() - (n - 1); ++i) {
-        NGram ngram;
-        for (int j = 0; j < n; ++j) {
-            ngram.words.push_back(testTokens[i + j]);
+    bool await_ready() const noexcept {
+        return std::all_of(queries.begin(), queries.end(), [](const ScoringQuery &query) { return query.keys.empty(); });
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+        for (auto &query : queries) {
+            loop.batch.push_back(&query);
         }
-        ngram.count = 0;
-        ngram.probability = 0.0;
-        testNgrams.push_back(ngram);
+        loop.batchWaiters.push_back(handle);
     }
+    void await_resume() const noexcept {}
+};
 
-    // assign matching probabilities from already-built 2-gram model
-    for (auto &testNgram : testNgrams) {
-        for (const auto &ngram: model) {
-            int matches = 0;
-            for (int i = 0; i < n; ++i) {
-                if (testNgram.words[i] == ngram.words[i]) {
-                    matches++;
-                }
+
+ConnectionTask serveConnection(ScoringEventLoop &loop, int socket) {
+    std::string input;
+    std::string output;
+    std::string payload;
+    char chunk[16384];
+
+    while (true) {
+        while (!takeFrame(input, payload)) {
+            if (input.size() >= 4 && frameLength(input) > MAX_FRAME_SIZE) {
+                co_return;
             }
-            // 2-gram found in model
-            if (matches == n) {
-                testNgram.probability = ngram.probability;
-                break;
+            ssize_t received = recv(socket, chunk, sizeof(chunk), 0);
+            if (received > 0) {
+                input.append(chunk, static_cast<size_t>(received));
+            }
+            else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await SocketReady{loop, socket, POLLIN};
             }
             else {
-                testNgram.probability = static_cast<double>(1) / static_cast<double>(model.size());
+                co_return;
             }
         }
-    }
 
-    return testNgrams;
-}
+        std::vector<ScoringQuery> queries;
+        for (const auto &request : splitLines(payload)) {
+            if (request == "stop") {
+                loop.running = false;
+                queries.emplace_back().response = "ok";
+                continue;
+            }
+            queries.push_back(prepareScoringQuery(*loop.models, request));
+        }
+        co_await QueriesResolved{loop, queries};
 
+        std::vector<std::string> responses;
+        responses.reserve(queries.size());
+        for (const auto &query : queries) {
+            responses.push_back(finishScoringQuery(query));
+        }
+        appendFrame(output, joinLines(responses));
 
-double calculateSentenceProbability(std::vector<NGram>& testNgrams) {
-    double probability = 1.0;
-    for (const auto& ngram : testNgrams) {
-        probability *= ngram.probability;
+        while (!output.empty()) {
+            ssize_t sent = send(socket, output.data(), output.size(), SEND_FLAGS);
+            if (sent > 0) {
+                output.erase(0, static_cast<size_t>(sent));
+            }
+            else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await SocketReady{loop, socket, POLLOUT};
+            }
+            else {
+                co_return;
+            }
+        }
     }
-    return probability;
 }
 
 
-double calculateModelPerplexity(const std::vector<NGram> &model) {
-    double perplexity = 1.0;
-    for (const auto &ngram: model) {
-        double buffer = std::pow(ngram.probability, -1 / static_cast<double>(model.size()));
-        perplexity *= buffer;
+// serves loaded models on a Unix domain socket until a client sends request "stop"
+//
+// every connection is a coroutine on a single thread, so models are used without any locking
+// all requests that arrive in the same poll round form one micro batch, whose lookups are resolved together
+void runScoringServer(const std::unordered_map<std::string, ModelSlot> &models, const std::string &socketPath) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "Unable to open the socket." << std::endl;
+        return;
     }
-    return perplexity;
-}
+    sockaddr_un address = unixSocketAddress(socketPath);
+    unlink(socketPath.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        std::cerr << "Unable to open the socket." << std::endl;
+        close(listener);
+        return;
+    }
+    fcntl(listener, F_SETFL, O_NONBLOCK);
 
+    ScoringEventLoop loop;
+    loop.models = &models;
+    std::vector<std::pair<ConnectionTask, int>> connections;
+    auto writing = [&loop]() {
+        return std::any_of(loop.waitingSockets.begin(), loop.waitingSockets.end(), [](const pollfd &fd) { return fd.events & POLLOUT; });
+    };
 
-double calculatePerplexity(const std::vector<NGram> &model, std::vector<std::string>& testTokens, int n) {
-    // acquire words for N-grams from vector of test tokens
-    std::vector<double> probabilities;
-    bool matchFound = false;
-    for (size_t i = 0; i < testTokens.size() - (n - 1); ++i) {
-        std::vector<std::string> words;
-        for (size_t j = 0; j < n; ++j) {
-            words.push_back(testTokens[i + j]);
+    // after stop, responses that are still being written are finished
+    while (loop.running || !loop.batch.empty() || writing()) {
+        if (!loop.batch.empty()) {
+            resolveScoringQueries(loop.batch);
+            loop.batch.clear();
+            std::vector<std::coroutine_handle<>> waiters = std::move(loop.batchWaiters);
+            loop.batchWaiters.clear();
+            for (auto handle : waiters) {
+                handle.resume();
+            }
         }
+        else {
+            std::vector<pollfd> fds = loop.waitingSockets;
+            fds.push_back({listener, static_cast<short>(loop.running ? POLLIN : 0), 0});
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                continue;
+            }
 
-        // apply N-gram model to test tokens (words)
-        for (const auto &ngram : model) {
-            int matches = 0;
-            // find matches inside current N-gram
-            for (size_t k = 0; k < words.size(); ++k) {
-                if (ngram.words[k] == words[k]) {
-                    matches++;
+            if (fds.back().revents & POLLIN) {
+                for (int socket; (socket = accept(listener, nullptr, nullptr)) >= 0;) {
+                    fcntl(socket, F_SETFL, O_NONBLOCK);
+                    connections.emplace_back(serveConnection(loop, socket), socket);
                 }
             }
-            // if match found
-            if (matches == n) {
-                probabilities.push_back(ngram.probability);
-                matchFound = true;
-                break;
+
+            // ready coroutines are taken off the waiting list before they are resumed, as they may wait again
+            // (new connections have already been added behind polled sockets)
+            std::vector<std::coroutine_handle<>> ready;
+            std::vector<pollfd> waitingSockets;
+            std::vector<std::coroutine_handle<>> waitingHandles;
+            for (size_t i = 0; i < loop.waitingSockets.size(); ++i) {
+                if (i + 1 < fds.size() && fds[i].revents != 0) {
+                    ready.push_back(loop.waitingHandles[i]);
+                }
+                else {
+                    waitingSockets.push_back(loop.waitingSockets[i]);
+                    waitingHandles.push_back(loop.waitingHandles[i]);
+                }
             }
-            // Good Turing for zero frequency tokens (not yet seen tokens) --> c* / N
-            if (!matchFound) {
-                const unsigned int N = model.size();
-                const double c_asterisk = 1.0;
-                probabilities.push_back(c_asterisk/N);
-                break;
+            loop.waitingSockets = std::move(waitingSockets);
+            loop.waitingHandles = std::move(waitingHandles);
+            for (auto handle : ready) {
+                handle.resume();
             }
         }
+
+        for (auto &[task, socket] : connections) {
+            if (task.handle.done()) {
+                task.handle.destroy();
+                close(socket);
+                socket = -1;
+            }
+        }
+        connections.erase(std::remove_if(connections.begin(), connections.end(), [](const auto &connection) { return connection.second < 0; }), connections.end());
     }
 
-    double perplexity = 1.0;
-    for (const auto &p : probabilities) {
-        double buffer = std::pow(p, -1 / static_cast<double>(testTokens.size()));
-        perplexity *= buffer;
+    for (auto &[task, socket] : connections) {
+        task.handle.destroy();
+        close(socket);
     }
-    return perplexity;
+    close(listener);
+    unlink(socketPath.c_str());
+}
+
+
+// sends a batch of requests in a single frame and waits for their responses
+std::vector<std::string> sendScoringRequests(const std::string &socketPath, const std::vector<std::string> &requests) {
+    int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unixSocketAddress(socketPath);
+    if (socket < 0 || connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        std::cerr << "Unable to connect to the scoring server." << std::endl;
+        if (socket >= 0) {
+            close(socket);
+        }
+        return {};
+    }
+
+    std::string buffer;
+    appendFrame(buffer, joinLines(requests));
+    for (size_t offset = 0; offset < buffer.size();) {
+        ssize_t sent = send(socket, buffer.data() + offset, buffer.size() - offset, SEND_FLAGS);
+        if (sent <= 0) {
+            close(socket);
+            return {};
+        }
+        offset += static_cast<size_t>(sent);
+    }
+
+    buffer.clear();
+    std::string payload;
+    char chunk[65536];
+    while (!takeFrame(buffer, payload)) {
+        ssize_t received = recv(socket, chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+            close(socket);
+            return {};
+        }
+        buffer.append(chunk, static_cast<size_t>(received));
+    }
+    close(socket);
+    return splitLines(payload);
 }
 
+#endif
+
 
 void ngramMenu() {
     std::cout << std::endl;
@@ -480,6 +4136,12 @@ void ngramMenu() {
     std::cout << "2 ... 2-GRAM" << std::endl;
     std::cout << "3 ... 3-GRAM" << std::endl;
     std::cout << "4 ... EXIT" << std::endl;
+    std::cout << "5 ... INTERPOLATED MIXTURE OF MODELS" << std::endl;
+    std::cout << "6 ... NEXT WORD PREDICTION" << std::endl;
+    std::cout << "7 ... TEXT GENERATION" << std::endl;
+    std::cout << "8 ... PER-DOMAIN MODELS FROM DOCUMENT METADATA" << std::endl;
+    std::cout << "9 ... SCORING SERVER" << std::endl;
+    std::cout << "10 .. SCORING CLIENT" << std::endl;
     std::cout << "======================================================" << std::endl;
     std::cout << "Your choice: ";
 }
@@ -518,11 +4180,65 @@ int main() {
     std::cout << "number of all words in corpus: " << corpusWords.size() << std::endl;
     std::cout << "number of words in vocabulary (unique corpus words): " << vocabulary.size() << std::endl;*/
 
-    // preprocess train corpus
-    std::vector<std::string> trainTokens = preprocessAndTokenize(trainFileName, false);
-
     bool buildModel = false;
 
+    // reading, tokenization and counting run concurrently on chunks of the train corpus
+    bool pipelinedTraining = false;
+
+    // N-grams are counted on all cores into a shared sharded count table
+    bool parallelCounting = false;
+
+    // N-grams are counted by sorting all N-gram keys of the train corpus
+    bool sortBasedBuild = false;
+
+    // preprocess train corpus (pipelined training tokenizes on the fly)
+    std::vector<std::string> trainTokens;
+    if (!pipelinedTraining) {
+        trainTokens = preprocessAndTokenize(trainFileName, false);
+    }
+
+    // pruning of built models before they are saved
+    bool pruneBuiltModel = false;
+    PruningOptions pruningOptions;
+    pruningOptions.minCounts = {1, 1, 2, 2};
+    pruningOptions.entropyThreshold = 1e-7;
+
+    // counting with Count-Min sketch instead of exact counts (for very large corpora)
+    bool approximateCounting = false;
+    ApproximateCountingOptions approximateCountingOptions;
+
+    // index of binary models (hashing or sorted search tree)
+    ModelLayout binaryModelLayout = PERFECT_HASH;
+
+    // throughput of sampling from alias tables after text generation
+    bool benchmarkTextGeneration = false;
+
+    // throughput of single and batch lookups in binary models after evaluation
+    bool benchmarkLookups = false;
+
+    // returns columns of the model and fills N-grams for the text file
+    // sort-based build produces columns directly, all other builders produce N-grams
+    auto buildSelectedModel = [&](int n, SmoothingType smoothingType, std::vector<NGram> &ngrams) {
+        if (pipelinedTraining) {
+            ngrams = buildNGramsPipelined<NGram>({trainFileName}, n, smoothingType);
+        }
+        else if (sortBasedBuild) {
+            ColumnarModel columnarModel = buildColumnarModelSorted(trainTokens, n, smoothingType);
+            ngrams = toNGrams(columnarModel);
+            return columnarModel;
+        }
+        else if (parallelCounting) {
+            ngrams = buildNGramsParallel<NGram>(trainTokens, n, smoothingType);
+        }
+        else if (approximateCounting) {
+            ngrams = buildNGramsApproximate<NGram>(trainTokens, n, smoothingType, approximateCountingOptions);
+        }
+        else {
+            ngrams = buildNGrams<NGram>(trainTokens, n, smoothingType);
+        }
+        return toColumnarModel(ngrams, n);
+    };
+
     bool running = true;
     int ngramSelection;
 
@@ -549,8 +4265,18 @@ int main() {
             }
 
             if (buildModel) {
-                std::vector<NGram> model = buildNGrams<NGram>(trainTokens, 2, smoothingType);
+                std::vector<NGram> model;
+                ColumnarModel columnarModel = buildSelectedModel(2, smoothingType, model);
+                if (pruneBuiltModel) {
+                    std::vector<NGram> prunedModel = pruneNGrams(model, 2, pruningOptions);
+                    reportPruning(model, prunedModel, preprocessAndTokenize(testFileName, false), 2);
+                    model = std::move(prunedModel);
+                    columnarModel = toColumnarModel(model, 2);
+                }
+                printModelStatistics(calculateModelStatistics(columnarModel));
+                printNormalisationReport(verifyNormalisation(columnarModel, 1e-3));
                 saveModelToFile(model, corpusNameShort);
+                saveModelToBinaryFile(createStaticModel(std::move(columnarModel), binaryModelLayout), binaryModelName(corpusNameShort));
             }
 
             // load model from file
@@ -562,9 +4288,19 @@ int main() {
             std::vector<NGram> testNgrams = createTestNgrams(loadedModel, testTokens, 2);
             double probability = calculateSentenceProbability(testNgrams);
             std::cout << std::endl << "probability of sentence: " << probability << std::endl;
-            double perplexity = calculatePerplexity(loadedModel, testTokens, 2);
+            BloomFilter filter = readBloomFilter(corpusNameShort + ".bloom", bloomModelFingerprint(loadedModel));
+            double perplexity = calculatePerplexity(loadedModel, testTokens, 2, &filter);
             //double modelPerplexity = calculateModelPerplexity(loadedModel);
             std::cout << std::endl << "perplexity of 2-gram model: " << perplexity << std::endl;
+
+            // same model from binary file, looked up through minimal perfect hash
+            StaticModel binaryModel = readBinaryModel(binaryModelName(corpusNameShort));
+            if (binaryModel.columns.n == 2) {
+                std::cout << "perplexity of binary 2-gram model: " << calculatePerplexity(binaryModel, testTokens) << std::endl;
+                if (benchmarkLookups) {
+                    benchmarkBatchLookup(binaryModel, testTokens, 10);
+                }
+            }
         }
         else if (ngramSelection == 3) {
             int smoothingSelection;
@@ -585,8 +4321,18 @@ int main() {
             }
 
             if (buildModel) {
-                std::vector<NGram> model = buildNGrams<NGram>(trainTokens, 3, smoothingType);
+                std::vector<NGram> model;
+                ColumnarModel columnarModel = buildSelectedModel(3, smoothingType, model);
+                if (pruneBuiltModel) {
+                    std::vector<NGram> prunedModel = pruneNGrams(model, 3, pruningOptions);
+                    reportPruning(model, prunedModel, preprocessAndTokenize(testFileName, false), 3);
+                    model = std::move(prunedModel);
+                    columnarModel = toColumnarModel(model, 3);
+                }
+                printModelStatistics(calculateModelStatistics(columnarModel));
+                printNormalisationReport(verifyNormalisation(columnarModel, 1e-3));
                 saveModelToFile(model, corpusNameShort);
+                saveModelToBinaryFile(createStaticModel(std::move(columnarModel), binaryModelLayout), binaryModelName(corpusNameShort));
             }
 
             // load model from file
@@ -598,9 +4344,202 @@ int main() {
             std::vector<NGram> testNgrams = createTestNgrams(loadedModel, testTokens, 3);
             double probability = calculateSentenceProbability(testNgrams);
             std::cout << std::endl << "probability of sentence: " << probability << std::endl;
-            double perplexity = calculatePerplexity(loadedModel, testTokens, 3);
+            BloomFilter filter = readBloomFilter(corpusNameShort + ".bloom", bloomModelFingerprint(loadedModel));
+            double perplexity = calculatePerplexity(loadedModel, testTokens, 3, &filter);
             //double modelPerplexity = calculateModelPerplexity(loadedModel);
             std::cout << std::endl << "perplexity of 3-gram model: " << perplexity << std::endl;
+
+            // same model from binary file, looked up through minimal perfect hash
+            StaticModel binaryModel = readBinaryModel(binaryModelName(corpusNameShort));
+            if (binaryModel.columns.n == 3) {
+                std::cout << "perplexity of binary 3-gram model: " << calculatePerplexity(binaryModel, testTokens) << std::endl;
+                if (benchmarkLookups) {
+                    benchmarkBatchLookup(binaryModel, testTokens, 10);
+                }
+            }
+        }
+        else if (ngramSelection == 5) {
+            int n;
+            std::cout << "N-gram size of mixed models (2 or 3): ";
+            std::cin >> n;
+            std::string suffix = (n == 2) ? "-bigrams.txt" : "-trigrams.txt";
+
+            int smoothingSelection;
+            smoothingMenu();
+            std::cin >> smoothingSelection;
+            std::string smoothingName = (smoothingSelection == 1) ? "-good-turing" : "-kneser-ney";
+
+            // per-domain models used as mixture components
+            std::vector<std::vector<NGram>> components;
+            for (const std::string componentName : {"kas-5000", "kas-8000", "kas-26000"}) {
+                components.push_back(readModel(componentName + smoothingName + suffix, n));
+                if (components.back().empty()) {
+                    std::cerr << "Model " << componentName + smoothingName + suffix << " is missing or empty." << std::endl;
+                }
+            }
+            MixtureModel mixture = createMixtureModel(components, n);
+            if (mixture.probabilities.empty()) {
+                std::cerr << "Mixture can not be built, build all component models first." << std::endl;
+                continue;
+            }
+
+            // first half of test corpus is used as held-out set for tuning weights, second half for evaluation
+            std::vector<std::string> testTokens = preprocessAndTokenize(testFileName, false);
+            std::vector<std::string> heldOutTokens(testTokens.begin(), testTokens.begin() + testTokens.size() / 2);
+            std::vector<std::string> evaluationTokens(testTokens.begin() + testTokens.size() / 2, testTokens.end());
+
+            std::cout << std::endl << "perplexity with uniform weights: " << calculateMixturePerplexity(mixture, evaluationTokens, LINEAR) << std::endl;
+            tuneMixtureWeights(mixture, heldOutTokens, 20);
+            std::cout << "tuned weights:";
+            for (const auto &weight : mixture.weights) {
+                std::cout << " " << weight;
+            }
+            std::cout << std::endl;
+            std::cout << "perplexity of linear mixture: " << calculateMixturePerplexity(mixture, evaluationTokens, LINEAR) << std::endl;
+            std::cout << "perplexity of log-linear mixture (unnormalised): " << calculateMixturePerplexity(mixture, evaluationTokens, LOG_LINEAR) << std::endl;
+        }
+        else if (ngramSelection == 6) {
+            int n;
+            std::cout << "N-gram size of model (2 or 3): ";
+            std::cin >> n;
+            std::string suffix = (n == 2) ? "-bigrams.txt" : "-trigrams.txt";
+
+            int smoothingSelection;
+            smoothingMenu();
+            std::cin >> smoothingSelection;
+            std::string smoothingName = (smoothingSelection == 1) ? "-good-turing" : "-kneser-ney";
+
+            std::string modelFileName = corpusName.substr(0, dotPos) + smoothingName + suffix;
+            NextWordIndex index = buildNextWordIndex(readModel(modelFileName, n), n);
+
+            // typed text is also scored as it grows, if the binary model has been built
+            StaticModel binaryModel;
+            if (std::filesystem::exists(binaryModelName(modelFileName))) {
+                binaryModel = readBinaryModel(binaryModelName(modelFileName));
+            }
+            StreamingScorer scorer = createStreamingScorer(binaryModel);
+
+            std::cout << std::endl << "enter text (empty line to stop): " << std::endl;
+            std::string line;
+            std::getline(std::cin >> std::ws, line);
+            while (!line.empty()) {
+                // history is normalized the same way as corpus tokens
+                std::istringstream iss(line);
+                std::vector<std::string> history;
+                std::string token;
+                while (iss >> token) {
+                    normalizeToken(token);
+                    history.push_back(token);
+                }
+                if (binaryModel.columns.n == n) {
+                    for (const auto &token : history) {
+                        appendToken(scorer, token);
+                    }
+                    std::cout << "perplexity of text so far: " << streamingPerplexity(scorer) << std::endl;
+                }
+
+                for (const auto &[word, probability] : predictNextWords(index, history, 5)) {
+                    std::cout << word << " (" << probability << ")" << std::endl;
+                }
+                std::getline(std::cin, line);
+            }
+        }
+        else if (ngramSelection == 7) {
+            int n;
+            std::cout << "N-gram size of model (2 or 3): ";
+            std::cin >> n;
+            std::string suffix = (n == 2) ? "-bigrams.txt" : "-trigrams.txt";
+
+            int smoothingSelection;
+            smoothingMenu();
+            std::cin >> smoothingSelection;
+            std::string smoothingName = (smoothingSelection == 1) ? "-good-turing" : "-kneser-ney";
+
+            TextGenerator generator = createTextGenerator(buildNextWordIndex(readModel(corpusName.substr(0, dotPos) + smoothingName + suffix, n), n));
+
+            std::mt19937_64 rng(std::random_device{}());
+            std::cout << std::endl << "sampled sentences:" << std::endl;
+            for (int i = 0; i < 5; ++i) {
+                for (const auto &word : generateSentence(generator, rng, 50)) {
+                    std::cout << word << " ";
+                }
+                std::cout << std::endl;
+            }
+
+            std::cout << std::endl << "beam search sentence:" << std::endl;
+            for (const auto &word : beamSearchSentence(generator, 5, 50)) {
+                std::cout << word << " ";
+            }
+            std::cout << std::endl << std::endl;
+
+            if (benchmarkTextGeneration) {
+                benchmarkSampling(generator, 10000000);
+            }
+        }
+        else if (ngramSelection == 8) {
+            int n;
+            std::cout << "N-gram size of models (2 or 3): ";
+            std::cin >> n;
+            std::string suffix = (n == 2) ? "-bigrams.txt" : "-trigrams.txt";
+
+            int smoothingSelection;
+            smoothingMenu();
+            std::cin >> smoothingSelection;
+            SmoothingType smoothingType = (smoothingSelection == 1) ? GOOD_TURING : KNESER_NEY;
+            std::string smoothingName = (smoothingSelection == 1) ? "-good-turing" : "-kneser-ney";
+
+            std::vector<DocumentMetadata> documents = buildMetadataIndex(ABS_PATH);
+            std::cout << "documents in corpus: " << documents.size() << std::endl;
+
+            std::vector<TrainingDomain> domains = {
+                {"um-fvv", [](const DocumentMetadata &document) { return document.publisher == "UM FVV"; }},
+                {"ul-ef", [](const DocumentMetadata &document) { return document.publisher == "UL EF"; }},
+                {"before-2010", [](const DocumentMetadata &document) { return document.year > 0 && document.year < 2010; }},
+                {"from-2010", [](const DocumentMetadata &document) { return document.year >= 2010; }}
+            };
+            std::vector<std::vector<NGram>> domainModels = buildDomainModels(documents, domains, n, smoothingType);
+            for (size_t d = 0; d < domains.size(); ++d) {
+                std::cout << domains[d].name << ": " << domainModels[d].size() << " N-grams" << std::endl;
+                saveModelToFile(domainModels[d], domains[d].name + smoothingName + suffix);
+            }
+        }
+        else if (ngramSelection == 9) {
+#ifdef SCORING_SERVER_SUPPORTED
+            // every saved binary model is served under its name without extension,
+            // models rebuilt while the server is running are swapped in without restart
+            std::unordered_map<std::string, ModelSlot> models;
+            for (const std::string smoothingName : {"-good-turing", "-kneser-ney"}) {
+                for (const std::string suffix : {"-bigrams", "-trigrams"}) {
+                    std::string modelName = corpusName.substr(0, dotPos) + smoothingName + suffix;
+                    if (std::filesystem::exists(modelName + ".bin") && addModelSlot(models, modelName, modelName + ".bin", SERVED_MODEL_CACHE_CAPACITY)) {
+                        std::cout << "serving " << modelName << std::endl;
+                    }
+                }
+            }
+            ModelWatcher watcher;
+            startModelWatcher(watcher, models, std::chrono::milliseconds(1000));
+            runScoringServer(models, "vaja2.sock");
+            stopModelWatcher(watcher);
+#else
+            std::cerr << "Scoring server needs Unix domain sockets." << std::endl;
+#endif
+        }
+        else if (ngramSelection == 10) {
+#ifdef SCORING_SERVER_SUPPORTED
+            // request lines (see ScoringQuery) are sent as one batch to a server running in another process
+            std::cout << "requests, empty line sends them:" << std::endl;
+            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            std::vector<std::string> requests;
+            std::string request;
+            while (std::getline(std::cin, request) && !request.empty()) {
+                requests.push_back(request);
+            }
+            for (const auto &response : sendScoringRequests("vaja2.sock", requests)) {
+                std::cout << response << std::endl;
+            }
+#else
+            std::cerr << "Scoring client needs Unix domain sockets." << std::endl;
+#endif
         }
         else if (ngramSelection == 4) {
             running = false;